@@ -1,6 +1,8 @@
 // Copyright 2012, 2013, 2014 Keean Schupke
 // compile with g++ -std=gnu++11 
 
+#include "clors.hpp"
+
 #include <string>
 #include <vector>
 #include <forward_list>
@@ -16,6 +18,14 @@
 #include <set>
 #include <sstream>
 #include <type_traits>
+#include <algorithm>
+#include <chrono>
+#include <limits>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <exception>
 
 #include <ctime>
 #include <cassert>
@@ -24,6 +34,10 @@ extern "C" {
 #include <sys/resource.h>
 }
 
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
 #ifdef DEBUG
 #define IF_DEBUG(X) X
 #else
@@ -32,6 +46,10 @@ extern "C" {
 
 using namespace std;
 
+// the engine, hidden from embedders by the library interface below.
+namespace clors {
+namespace detail {
+
 //----------------------------------------------------------------------------
 // Profiling
 
@@ -170,17 +188,8 @@ public:
 //----------------------------------------------------------------------------
 // Recursive Descent Parser
 
-struct parse_error : public runtime_error {
-    int const row;
-    int const col;
-    int const sym;
-    string const exp;
-    parse_error(string const& what, int row, int col, string exp, int sym)
-        : runtime_error(what), row(row), col(col), exp(move(exp)), sym(sym) {}
-};
-
 class fparse {
-    fstream *in;
+    istream *in;
     int row;
     int col;
     int sym;
@@ -239,7 +248,7 @@ protected:
         while (accept(is_alnum, s));
     }
 
-    void set_fstream(fstream *f) {
+    void set_stream(istream *f) {
         in = f;
         row = 1;
         col = 1;
@@ -256,18 +265,194 @@ class type_attrvar;
 class type_atom;
 class type_struct;
 class type_clause;
+class goal_list;
+class heap;
+class principal;
+class and_pool;
 
-using env_type = map<type_atom*, vector<type_clause*>>;
 using atoms = map<string, type_atom*>;
 
+// ground atomic facts loaded in bulk, held by column: each cell is the id
+// of a symbol of the table. Symbols are kept as text in one pool, and an
+// atom is only made for a symbol when a goal is first resolved with a row
+// holding it, so rows need no term objects. Tables are only loaded while
+// no solver runs.
+class fact_table {
+    string pool;
+    vector<uint32_t> ends; // symbol i is the text of pool up to ends[i]
+    vector<type_atom*> made;
+    vector<uint32_t> slots; // open addressing index of symbol ids plus one, 0 is empty
+
+    static size_t hash(char const *const s, size_t const n) {
+        size_t h = 14695981039346656037ull;
+        for (size_t i = 0; i < n; ++i) {
+            h = (h ^ static_cast<unsigned char>(s[i])) * 1099511628211ull;
+        }
+        return h;
+    }
+
+    size_t begin(uint32_t const id) const {
+        return (id == 0) ? 0 : ends[id - 1];
+    }
+
+    // the slot of a symbol's text, empty if it is not a symbol.
+    uint32_t& slot(char const *const s, size_t const n) {
+        size_t const mask = slots.size() - 1;
+        for (size_t i = hash(s, n) & mask;; i = (i + 1) & mask) {
+            uint32_t const id = slots[i];
+            if (id == 0 || (ends[id - 1] - begin(id - 1) == n && pool.compare(begin(id - 1), n, s, n) == 0)) {
+                return slots[i];
+            }
+        }
+    }
+
+    void grow() {
+        vector<uint32_t> old(max<size_t>(16, slots.size() * 2), 0);
+        old.swap(slots);
+        for (uint32_t id = 0; id < ends.size(); ++id) {
+            slot(pool.data() + begin(id), ends[id] - begin(id)) = id + 1;
+        }
+    }
+
+public:
+    static size_t const max_arity = 32;
+
+    size_t arity;
+    size_t rows;
+    vector<vector<uint32_t>> columns;
+
+    fact_table() : arity(0), rows(0) {}
+
+    uint32_t intern(char const *const s, size_t const n) {
+        if (2 * (ends.size() + 1) > slots.size()) {
+            grow();
+        }
+        uint32_t& id = slot(s, n);
+        if (id == 0) {
+            pool.append(s, n);
+            ends.push_back(pool.size());
+            made.push_back(nullptr);
+            id = ends.size();
+        }
+        return id - 1;
+    }
+
+    // the id of a symbol, false if there is none.
+    bool find(string const& a, uint32_t& id) {
+        if (slots.empty()) {
+            return false;
+        }
+        uint32_t const s = slot(a.data(), a.size());
+        id = s - 1;
+        return s != 0;
+    }
+
+    type_atom* atom(uint32_t id, atoms& names, heap& h);
+
+    // the first row from row on whose columns bound[j] hold ids[j] for
+    // each j below n, or rows if there is none. With AVX2 eight rows of
+    // every bound column are compared at once.
+    size_t scan(size_t row, unsigned const *const bound, uint32_t const *const ids, unsigned const n) const {
+        if (n == 0) {
+            return row;
+        }
+        uint32_t const* cols[max_arity];
+        for (unsigned j = 0; j < n; ++j) {
+            cols[j] = columns[bound[j]].data();
+        }
+#ifdef __AVX2__
+        __m256i keys[max_arity];
+        for (unsigned j = 0; j < n; ++j) {
+            keys[j] = _mm256_set1_epi32(static_cast<int>(ids[j]));
+        }
+        for (; row + 8 <= rows; row += 8) {
+            __m256i eq = _mm256_cmpeq_epi32(_mm256_loadu_si256(reinterpret_cast<__m256i const*>(cols[0] + row)), keys[0]);
+            for (unsigned j = 1; j < n; ++j) {
+                eq = _mm256_and_si256(eq
+                    , _mm256_cmpeq_epi32(_mm256_loadu_si256(reinterpret_cast<__m256i const*>(cols[j] + row)), keys[j]));
+            }
+            unsigned const mask = static_cast<unsigned>(_mm256_movemask_ps(_mm256_castsi256_ps(eq)));
+            if (mask != 0) {
+                return row + __builtin_ctz(mask);
+            }
+        }
+#endif
+        for (; row < rows; ++row) {
+            unsigned j = 0;
+            while (j < n && cols[j][row] == ids[j]) {
+                ++j;
+            }
+            if (j == n) {
+                return row;
+            }
+        }
+        return rows;
+    }
+};
+
+// the clauses of a predicate, in order, with a mode index: for each
+// argument, the position after the last clause that could match a call
+// with a given principal functor there. A call with bound arguments stops
+// trying clauses past the last that could match any of them, so when the
+// clause heads are exclusive for its mode the call leaves no alternatives.
+// The index is extended as clauses are added.
+struct predicate : public vector<type_clause*> {
+    struct argument {
+        map<pair<type_atom*, int>, unsigned> last;
+        unsigned open; // the position after the last clause with a variable here
+
+        argument() : open(0) {}
+    };
+
+    vector<argument> modes;
+    fact_table *table; // rows resolved with before the clauses, or nullptr
+
+    predicate() : table(nullptr) {}
+
+    void add(type_clause *c, principal& functor_of);
+    void reindex(principal& functor_of);
+    unsigned last_match(type_struct *g, principal& functor_of) const;
+};
+
+// the clauses of each predicate. While a solver is running clauses are only
+// appended, and a retracted clause is stamped dead rather than removed, so
+// each call sees the clauses as they were when it was made (the logical
+// update view). Dead clauses are removed once no solver is running.
+struct env_type : public map<type_atom*, predicate> {
+    heap *store; // holds asserted clauses, outliving the queries that assert them
+    unsigned generation; // advanced by every update
+    unsigned running; // the number of live solvers
+    int last_id;
+    set<type_atom*> dirty; // predicates with dead clauses
+    vector<unique_ptr<fact_table>> tables;
+    unique_ptr<and_pool> workers; // for independent goals, made by the first solver that forks
+
+    env_type() : store(nullptr), generation(0), running(0), last_id(0) {}
+};
+
 //----------------------------------------------------------------------------
 // Expression Graph
 
 struct ast {
     virtual ~ast() {};
+
+    // the bytes the node holds, for memory accounting. Names are short
+    // enough to be held within their strings.
+    virtual size_t bytes() const = 0;
+};
+
+// records the canonical link a node had before it was changed, so that
+// backtracking can restore it.
+struct union_entry {
+    type_expression *const node;
+    type_expression *const prev;
+    bool const ranked;
+
+    union_entry(type_expression *node, type_expression *prev, bool ranked)
+        : node(node), prev(prev), ranked(ranked) {}
 };
 
-using union_stack = vector<pair<type_expression *const, bool const>>;
+using union_stack = vector<union_entry>;
 
 class type_expression : public ast {
     type_expression *canonical;
@@ -275,16 +460,16 @@ class type_expression : public ast {
 
 protected:
     type_expression() : canonical(this), rank(0) {}
+    explicit type_expression(int const rank) : canonical(this), rank(rank) {}
 
 public:
     virtual void accept(class type_visitor *v) = 0;
 
-    void deunion(bool ranked) {
+    virtual void deunion(type_expression *prev, bool ranked) {
         if (ranked) {
             --(canonical->rank);
         }
-        canonical = this;
-
+        canonical = prev;
     }
 
     // find the canonical type
@@ -294,6 +479,22 @@ public:
         }
         return e;
     }
+
+    // find the canonical type with path halving, each shortened link is
+    // recorded on the union stack so backtracking restores the chain.
+    friend type_expression* find(type_expression* e, union_stack& u) {
+        type_expression* p = e->canonical;
+        while (e != p) {
+            type_expression* const g = p->canonical;
+            if (p != g) {
+                u.emplace_back(e, p, false);
+                e->canonical = g;
+            }
+            e = g;
+            p = e->canonical;
+        }
+        return e;
+    }
    
     // let the algorithm pick the most efficient substitution
     friend void link(type_expression* x, type_expression* y, union_stack& u) {
@@ -304,19 +505,24 @@ public:
             ranked = true;
             ++(y->rank);
         }
+        u.emplace_back(x, x->canonical, ranked);
         x->canonical = y;
-        u.emplace_back(x, ranked);
     }
 
     friend void link2(type_attrvar*& x, type_attrvar*& y, union_stack& u);
 
+    // link a node allocated after every live checkpoint, so it needs no trail.
+    void bind_fresh(type_expression *e) {
+        canonical = e;
+    }
+
     void replace_with(type_expression *e, union_stack& u) {
         bool const ranked = (rank == e->rank);
         if (ranked) {
             ++(e->rank);
         }
+        u.emplace_back(this, canonical, ranked);
         canonical = e;
-        u.emplace_back(this, ranked);
     }
 };
 
@@ -324,23 +530,64 @@ class type_variable : public type_expression {
     friend class heap;
 
     template <typename T>
-    type_variable(T&& name) : name(forward<T>(name)) {}
+    type_variable(T&& name, int slot) : name(forward<T>(name)), slot(slot) {}
 
 public:
     string const name;
+    int const slot; // dense index within its stored clause, -1 if created at run time
+
+    virtual size_t bytes() const override {
+        return sizeof(*this);
+    }
 
     virtual void accept(class type_visitor *v) override;
 };
 
+// An attributed variable is the constraint store for a variable: a chain of
+// suspended goals, the head of the chain tracks its last link so that the
+// chains of two attributed variables can be joined in constant time.
+
 class type_attrvar : public type_expression {
     friend class heap;
 
-    type_attrvar(type_variable* var, type_struct* goal) : var(var), goal(goal), next(nullptr) {}
+    type_attrvar* joined_after;
+    type_attrvar* joined_to;
+
+    type_attrvar(type_variable* var, type_struct* goal, type_attrvar* next)
+        : joined_after(nullptr), joined_to(nullptr), var(var), goal(goal), next(next)
+        , last((next == nullptr) ? this : next->last), woken(0) {}
 
 public:
     type_variable* const var;
     type_struct* const goal;
     type_attrvar* next;
+    type_attrvar* last;
+    unsigned woken;
+
+    // append the chain of t to this chain, undone when the link of t below
+    // this is deunioned.
+    void join(type_attrvar *const t) {
+        t->joined_after = last;
+        t->joined_to = this;
+        last->next = t;
+        last = t->last;
+    }
+
+    // only the entry that linked this root restores it to itself, and so
+    // undoes the join; path halving entries restore a parent.
+    virtual void deunion(type_expression *prev, bool ranked) override {
+        if (joined_after != nullptr && prev == this) {
+            joined_after->next = nullptr;
+            joined_to->last = joined_after;
+            joined_after = nullptr;
+            joined_to = nullptr;
+        }
+        type_expression::deunion(prev, ranked);
+    }
+
+    virtual size_t bytes() const override {
+        return sizeof(*this);
+    }
 
     virtual void accept(class type_visitor *v) override;
 };
@@ -349,24 +596,96 @@ class type_atom : public type_expression {
     friend class heap;
 
 protected:
-    type_atom(string const value) : value(move(value)) {}
+    // an atom is never linked below another node, so its rank is fixed
+    // above any other: binding a variable to it writes only the variable,
+    // and solvers on other threads can share it.
+    type_atom(string const value) : type_expression(numeric_limits<int>::max()), value(move(value)) {}
 
 public:
     string const value;
 
+    virtual size_t bytes() const override {
+        return sizeof(*this);
+    }
+
     virtual void accept(class type_visitor *v) override;
 };
 
+// the arguments of a struct, stored after it in the same allocation.
+class arguments {
+    type_expression *const *const first;
+    uint32_t const n;
+
+public:
+    using const_iterator = type_expression *const*;
+
+    arguments(type_expression *const *const first, size_t const n) : first(first), n(n) {}
+
+    size_t size() const {
+        return n;
+    }
+
+    bool empty() const {
+        return n == 0;
+    }
+
+    type_expression* operator[] (size_t const i) const {
+        return first[i];
+    }
+
+    type_expression* at(size_t const i) const {
+        if (i >= n) {
+            throw out_of_range("argument index");
+        }
+        return first[i];
+    }
+
+    const_iterator begin() const {
+        return first;
+    }
+
+    const_iterator end() const {
+        return first + n;
+    }
+
+    const_iterator cbegin() const {
+        return first;
+    }
+
+    const_iterator cend() const {
+        return first + n;
+    }
+};
+
 class type_struct : public type_expression {
     friend class heap;
-    template <typename T>
-    type_struct(type_atom* const functor, T&& args, bool neg)
-        : functor(functor), args(forward<T>(args)), negated(neg) {}
+
+    type_expression** trailing() {
+        return reinterpret_cast<type_expression**>(this + 1);
+    }
+
+    template <typename I>
+    type_struct(type_atom* const functor, I const first, I const last, bool neg)
+        : functor(functor), args(trailing(), copy(first, last, trailing()) - trailing())
+        , negated(neg), ground(false) {}
+
+    static void* operator new(size_t const size, size_t const arity) {
+        return ::operator new(size + arity * sizeof(type_expression*));
+    }
 
 public:
+    static void operator delete(void *const p) {
+        ::operator delete(p);
+    }
+
     type_atom* const functor;
-    vector<type_expression*> const args;
+    arguments const args;
     bool const negated;
+    bool ground; // set on the ground subterms of stored clauses, see mark_ground
+
+    virtual size_t bytes() const override {
+        return sizeof(*this) + args.size() * sizeof(type_expression*);
+    }
 
     virtual void accept(class type_visitor *v) override;
 };
@@ -376,18 +695,45 @@ class type_clause : public type_expression {
 
 public:
     template <typename T, typename U>
-    type_clause(type_struct *head, T&& cyck, U&& impl, int id)
-        : head(head), cyck(forward<T>(cyck)), impl(forward<U>(impl)), id(id) {}
+    type_clause(type_struct *head, T&& cyck, U&& impl, int id, int vars)
+        : head(head), cyck(forward<T>(cyck)), impl(forward<U>(impl)), id(id), vars(vars)
+        , born(0), died(numeric_limits<unsigned>::max()), signature(0) {}
 
-    int const id;
+    int id; // renumbered when files parsed in parallel are merged
     type_struct *const head;
-    set<type_variable*> const cyck;
+    vector<type_variable*> const cyck;
     vector<type_struct*> const impl;
+    int const vars; // the number of variable slots of a stored clause
+    unsigned born; // the generations the clause is visible in, see env_type
+    unsigned died;
+    uint64_t signature; // of the head, set when added to its predicate
+
+    virtual size_t bytes() const override {
+        return sizeof(*this) + cyck.capacity() * sizeof(type_variable*) + impl.capacity() * sizeof(type_struct*);
+    }
 
     virtual void accept(class type_visitor *v) override;
 };
 
+//----------------------------------------------------------------------------
+// Goal List: a resolvent is a persistent list of goals, successive resolvents
+// share the tail of their parent, so only the resolved clause body is pushed.
+
+class goal_list : public ast {
+    friend class heap;
+
+    goal_list(type_struct *goal, goal_list *next)
+        : goal(goal), next(next), size((next == nullptr) ? 1 : next->size + 1) {}
 
+public:
+    type_struct *const goal;
+    goal_list *const next;
+    int const size;
+
+    virtual size_t bytes() const override {
+        return sizeof(*this);
+    }
+};
 
 struct type_visitor {
     virtual void visit(type_variable *t) = 0;
@@ -411,8 +757,8 @@ void link2(type_attrvar*& x, type_attrvar*& y, union_stack& u) {
         ranked = true;
         ++(y->rank);
     }
+    u.emplace_back(x, x->canonical, ranked);
     x->canonical = y;
-    u.emplace_back(x, ranked);
 }
 
 //----------------------------------------------------------------------------
@@ -421,8 +767,39 @@ void link2(type_attrvar*& x, type_attrvar*& y, union_stack& u) {
 class heap {
     vector<unique_ptr<ast>> region;
 
+    // live and peak bytes, counted once measure is called. Attributed
+    // variables are the constraint store, every other node is a term.
+    bool measured;
+    size_t terms;
+    size_t constraints;
+    size_t peak_terms;
+    size_t peak_constraints;
+
+    void keep(ast *const t) {
+        region.emplace_back(t);
+        if (measured) {
+            size_t const b = t->bytes() + sizeof(unique_ptr<ast>);
+            if (dynamic_cast<type_attrvar*>(t) != nullptr) {
+                constraints += b;
+                peak_constraints = max(peak_constraints, constraints);
+            } else {
+                terms += b;
+                peak_terms = max(peak_terms, terms);
+            }
+        }
+    }
+
+    void release(ast *const t) {
+        size_t const b = t->bytes() + sizeof(unique_ptr<ast>);
+        if (dynamic_cast<type_attrvar*>(t) != nullptr) {
+            constraints -= b;
+        } else {
+            terms -= b;
+        }
+    }
+
 public: 
-    heap() {};
+    heap() : measured(false), terms(0), constraints(0), peak_terms(0), peak_constraints(0) {};
     heap(const heap&) = delete;
     heap(heap&&) = default;
     heap& operator= (const heap&) = delete;
@@ -433,55 +810,163 @@ public:
 
     void backtrack(int p) {
         while (region.size() > p) {
+            if (measured) {
+                release(region.back().get());
+            }
             region.pop_back();
         }
     }
 
+    void measure() {
+        measured = true;
+    }
+
+    size_t term_bytes() const {
+        return terms;
+    }
+
+    size_t constraint_bytes() const {
+        return constraints;
+    }
+
+    size_t peak_term_bytes() const {
+        return peak_terms;
+    }
+
+    size_t peak_constraint_bytes() const {
+        return peak_constraints;
+    }
+
     // Types
     template <typename T>
-    type_variable* new_type_variable(T&& n) {
-        type_variable *const t = new type_variable(n);
-        region.emplace_back(t);
+    type_variable* new_type_variable(T&& n, int slot = -1) {
+        type_variable *const t = new type_variable(n, slot);
+        keep(t);
         return t;
     }
 
-    type_attrvar* new_type_attrvar(type_variable* v, type_struct* g) {
-        type_attrvar* const t = new type_attrvar(v, g);
-        region.emplace_back(t);
+    type_attrvar* new_type_attrvar(type_variable* v, type_struct* g, type_attrvar* next = nullptr) {
+        type_attrvar* const t = new type_attrvar(v, g, next);
+        keep(t);
         return t;
     }
 
     type_atom* new_type_atom(string const& value) {
         type_atom *const t = new type_atom(value);
-        region.emplace_back(t);
+        keep(t);
         return t;
     }
 
-    template <typename T>
-    type_struct* new_type_struct(type_atom* const functor, T&& args, bool neg) {
-        type_struct *const t = new type_struct(functor, forward<T>(args), neg);
-        region.emplace_back(t);
+    // the arguments are copied after the struct, in the same allocation.
+    template <typename I>
+    type_struct* new_type_struct(type_atom* const functor, I const first, I const last, bool neg) {
+        type_struct *const t = new (static_cast<size_t>(last - first)) type_struct(functor, first, last, neg);
+        keep(t);
         return t;
     }
 
-    template <typename T = set<type_variable*>, typename U = vector<type_struct*>>
+    type_struct* new_type_struct(type_atom* const functor, vector<type_expression*> const& args, bool neg) {
+        return new_type_struct(functor, args.cbegin(), args.cend(), neg);
+    }
+
+    template <typename T = vector<type_variable*>, typename U = vector<type_struct*>>
     type_clause* new_type_clause(type_struct *head
-    , T&& cyck = set<type_variable*> {}, U&& goals = vector<type_struct*> {}
-    , int id = 0) {
-        type_clause *const t = new type_clause(head, forward<T>(cyck), forward<U>(goals), id);
-        region.emplace_back(t);
+    , T&& cyck = vector<type_variable*> {}, U&& goals = vector<type_struct*> {}
+    , int id = 0, int vars = 0) {
+        type_clause *const t = new type_clause(head, forward<T>(cyck), forward<U>(goals), id, vars);
+        keep(t);
+        return t;
+    }
+
+    goal_list* new_goal_list(type_struct *goal, goal_list *next) {
+        goal_list *const t = new goal_list(goal, next);
+        keep(t);
         return t;
     }
+
+    // push goals from [begin, end) onto the front of next, preserving order
+    template <typename I>
+    goal_list* new_goal_list(I const begin, I end, goal_list *next) {
+        while (end != begin) {
+            next = new_goal_list(*(--end), next);
+        }
+        return next;
+    }
+};
+
+//----------------------------------------------------------------------------
+// Flat Map: open addressing with linear probing. Slots are live when their
+// stamp matches the map's, so clearing is O(1) and keeps both the slots and
+// the storage of their keys, and a reused map stops allocating.
+
+template <typename K, typename V, typename H = hash<K>> class flat_map {
+    struct slot {
+        K key;
+        V value;
+        unsigned stamp;
+
+        slot() : stamp(0) {}
+    };
+
+    vector<slot> slots;
+    size_t live;
+    unsigned stamp;
+
+    void grow() {
+        vector<slot> old(slots.size() * 2);
+        old.swap(slots);
+        live = 0;
+        for (slot& s : old) {
+            if (s.stamp == stamp) {
+                bool fresh;
+                insert(s.key, fresh) = s.value;
+            }
+        }
+    }
+
+public:
+    flat_map() : slots(16), live(0), stamp(1) {}
+
+    void clear() {
+        live = 0;
+        if (++stamp == 0) {
+            for (slot& s : slots) {
+                s.stamp = 0;
+            }
+            stamp = 1;
+        }
+    }
+
+    // the value for key, fresh is set when it was inserted.
+    V& insert(K const& key, bool& fresh) {
+        if (2 * (live + 1) > slots.size()) {
+            grow();
+        }
+        size_t const mask = slots.size() - 1;
+        for (size_t i = H {}(key) & mask;; i = (i + 1) & mask) {
+            slot& s = slots[i];
+            if (s.stamp != stamp) {
+                s.key = key;
+                s.value = V {};
+                s.stamp = stamp;
+                ++live;
+                fresh = true;
+                return s.value;
+            } else if (s.key == key) {
+                fresh = false;
+                return s.value;
+            }
+        }
+    }
 };
 
 //----------------------------------------------------------------------------
-// Show Type Graph - assumes no cycles
+// Show Type Graph - assumes no cycles. Output is built in a buffer that is
+// reused between terms, and written out once per term.
 
 class var_map {
-    using map_type = map<type_variable*, int>;
-    using map_name = map<string, int>;
-    map_type tmap;
-    map_name nmap;
+    flat_map<type_variable*, int> tmap;
+    flat_map<string, int> nmap;
 
 public:
     void clear() {
@@ -490,53 +975,67 @@ public:
     }
 
     int get(type_variable *t) {
-        map_type::iterator const i = tmap.find(t);
-        if (i == tmap.end()) {
-            map_name::iterator const j = nmap.find(t->name);
-            int id = 1;
-            if (j == nmap.end()) {
-                nmap[t->name] = id;
-            } else {           
-                id = ++(j->second);
-            }
-            tmap[t] = id;
-            return id;
-        } else {
-            return i->second;
+        bool fresh;
+        int& id = tmap.insert(t, fresh);
+        if (fresh) {
+            id = ++nmap.insert(t->name, fresh);
         }
+        return id;
     }
 };
 
 class type_show : public type_visitor {
     var_map tvar_map;
+    ostream& out;
+    string buf;
     bool debug;
     bool top;
     bool constraint;
 
+    void show_int(int x) {
+        char digits[12];
+        int n = 0;
+        unsigned u = (x < 0) ? -static_cast<unsigned>(x) : x;
+        do {
+            digits[n++] = '0' + u % 10;
+            u /= 10;
+        } while (u != 0);
+        if (x < 0) {
+            buf += '-';
+        }
+        while (n > 0) {
+            buf += digits[--n];
+        }
+    }
+
     void show_variable(type_variable *const t) {
-        int const x {tvar_map.get(t)};
-        stringstream ss;
-        ss << t->name << x;
-        cout << ss.str();
+        buf += t->name;
+        show_int(tvar_map.get(t));
     }
 
     void show_struct(type_struct *const t) {
         if (t->negated) {
-            cout << "-";
+            buf += '-';
         }
-        cout << t->functor->value;
+        buf += t->functor->value;
         if (t->args.size() > 0) {
-            cout << "(";
+            buf += '(';
             for (auto i = t->args.begin(); i != t->args.end(); ++i) {
                 (*i)->accept(this);
                 if (i + 1 != t->args.end()) {
-                    cout << ", ";
+                    buf += ", ";
                 }
             }
-            cout << ")";
+            buf += ')';
         }
     }
 
+    void show_term(type_expression *const t) {
+        constraint = false;
+        top = true;
+        t->accept(this);
+    }
+
 public:
     virtual void visit(type_variable *const t) override {
         if (top) {
@@ -544,7 +1043,7 @@ public:
             show_variable(t);
             type_expression *const e = find(t);
             if (t != e) {
-                cout << " = ";
+                buf += " = ";
                 e->accept(this);
             }
             top = true;
@@ -562,23 +1061,22 @@ public:
         show_variable(t->var);
         if (!constraint && t->goal != nullptr) {
             constraint = true;
-            cout << "{";
-            int j = 0;
+            buf += '{';
             for (auto i = t; i != nullptr; i = i->next) {
-                ++j;
-                assert(i->goal != nullptr);
-                show_struct(i->goal);
-                if (i->next != nullptr) {
-                    cout << ", ";
+                if (i->goal != nullptr) {
+                    if (i != t) {
+                        buf += ", ";
+                    }
+                    show_struct(i->goal);
                 }
             }
-            cout << "} ";
+            buf += "} ";
             constraint = false;
         }
     }
 
     virtual void visit(type_atom *const t) override {
-        cout << t->value;
+        buf += t->value;
     }
 
     virtual void visit(type_struct *const t) override {
@@ -586,50 +1084,96 @@ public:
     }
 
     virtual void visit(type_clause *const t) override {
-        cout << t->id << ".\t";
+        show_int(t->id);
+        buf += ".\t";
         show_struct(t->head);
         IF_DEBUG(
             if (t->cyck.size() > 0) {
-                cout << " [";
-                for (set<type_variable*>::iterator i = t->cyck.begin(); i != t->cyck.end();) {
+                buf += " [";
+                for (auto i = t->cyck.begin(); i != t->cyck.end();) {
                     show_variable(*i);
                     ++i;
                     if (i != t->cyck.end()) {
-                        cout << ", ";
+                        buf += ", ";
                     }
                 }
-                cout << "]";
+                buf += ']';
             }
         )
         if (t->impl.size() > 0) {
-            cout << " :-\n";
+            buf += " :-\n";
             for (auto i = t->impl.begin(); i != t->impl.end(); ++i) {
-                cout << "\t";
+                buf += '\t';
                 show_struct(*i);
                 if (i + 1 != t->impl.end()) {
-                    cout << ",\n";
+                    buf += ",\n";
                 }
             }
         }
     }
 
-    explicit type_show(bool debug = false) : debug(debug) {}
+    explicit type_show(bool debug = false, ostream& out = cout) : out(out), debug(debug) {}
 
     void operator() (type_expression *const t) {
         if (t != nullptr) {
-            constraint = false;
-            top = true;
-            t->accept(this);
+            show_term(t);
+            flush();
         }
     }
 
+    // the text of a term, valid until the next term is shown.
+    string const& str(type_expression *const t) {
+        buf.clear();
+        show_term(t);
+        return buf;
+    }
+
     template <typename T> void range(typename T::const_iterator const begin, typename T::const_iterator const end) {
         for (typename T::const_iterator i = begin; i != end; ++i) {
-            operator() (*i);
+            if (*i != nullptr) {
+                show_term(*i);
+            }
             if (i + 1 != end) {
-                cout << ", ";
+                buf += ", ";
+            }
+        }
+        flush();
+    }
+
+    // show a substitution of variable, value pairs.
+    template <typename T> void bindings(T const& bs) {
+        for (auto i = bs.cbegin(); i != bs.cend(); ++i) {
+            constraint = false;
+            top = false;
+            show_variable(i->first);
+            buf += " = ";
+            find(i->second)->accept(this);
+            if (i + 1 != bs.cend()) {
+                buf += ", ";
             }
         }
+        flush();
+    }
+
+    // the text of a value, without the bindings of its variables.
+    string const& value(type_expression *const t) {
+        buf.clear();
+        constraint = false;
+        top = false;
+        find(t)->accept(this);
+        return buf;
+    }
+
+    // the name a variable is shown with.
+    string const& name(type_variable *const t) {
+        buf.clear();
+        show_variable(t);
+        return buf;
+    }
+
+    void flush() {
+        out.write(buf.data(), buf.size());
+        buf.clear();
     }
 
     void reset() {
@@ -642,6 +1186,8 @@ public:
 
 class is_ground : public type_visitor {
     vector<type_expression*> todo;
+
+public:
     enum result {none, variable, attributed} result;
     type_variable* var;
     type_attrvar* attr;
@@ -687,114 +1233,359 @@ class is_ground : public type_visitor {
 };
         
 //----------------------------------------------------------------------------
-// Get Vars - assumes no cycles
-
-class get_variables : public type_visitor {
-    using tvars_type = set<type_variable*>;
+// Mark Ground: flag the ground structs of a clause when it is loaded, so
+// instantiating the clause shares them instead of copying them. Only terms
+// that live as long as the program may be marked.
 
-    tvars_type tvars;
+class mark_ground : public type_visitor {
+    bool ground;
 
 public:
-    virtual void visit(type_variable *const t) override {
-        tvars.insert(t);
+    virtual void visit(type_variable *const) override {
+        ground = false;
     }
 
-    virtual void visit(type_attrvar *const t) override {
-        tvars.insert(t->var);
+    virtual void visit(type_attrvar *const) override {
+        ground = false;
     }
 
-    virtual void visit(type_atom *const t) override {}
+    virtual void visit(type_atom *const) override {
+        ground = true;
+    }
 
     virtual void visit(type_struct *const t) override {
-        for (type_expression *const u : t->args) {
-            find(u)->accept(this);
+        bool g = true;
+        for (type_expression *const e : t->args) {
+            find(e)->accept(this);
+            g = g && ground;
         }
+        t->ground = g;
+        ground = g;
     }
 
     virtual void visit(type_clause *const t) override {
-        find(t->head)->accept(this);
-        for (type_struct *const u : t->impl) {
-            find(u)->accept(this);
+        if (t->head != nullptr) {
+            visit(t->head);
+        }
+        for (type_struct *const s : t->impl) {
+            visit(s);
         }
     }
 
-    vector<type_expression*> operator() (vector<type_struct *> const ts) {
-        tvars.clear();
-        for (auto const &t : ts) {
-            find(t)->accept(this);
-        }
-        vector<type_expression*> args;
-        args.assign(tvars.begin(), tvars.end());
-        return move(args);
+    void operator() (type_expression *const t) {
+        t->accept(this);
     }
 };
 
 //----------------------------------------------------------------------------
-// Instantiate Type - assumes no cycles
+// Principal Functor: the functor and arity at the root of a term, none for
+// variables. Terms with different principal functors do not unify.
 
-class type_instantiate : public type_visitor {
-    using tvar_map_type = map<type_variable*, type_variable*>;
+class principal : public type_visitor {
+    pair<type_atom*, int> key;
 
-    heap& ast;
-    tvar_map_type tvar_map;
-    type_expression *exp;
+public:
+    virtual void visit(type_variable *const) override {
+        key = make_pair(nullptr, 0);
+    }
 
-    type_struct* inst_struct(type_struct *const t) {
-        vector<type_expression*> args;
-        for (type_expression *const e : t->args) {
-            find(e)->accept(this);
-            args.push_back(exp);
-        }
-        return ast.new_type_struct(t->functor, move(args), t->negated);
+    virtual void visit(type_attrvar *const) override {
+        key = make_pair(nullptr, 0);
     }
 
-    type_variable* inst_var(type_variable *const t) {
-        tvar_map_type::iterator const i = tvar_map.find(t);
-        if (i == tvar_map.end()) { // fresh type variable
-            type_variable *const n = ast.new_type_variable(t->name);
-            tvar_map.emplace(t, n);
-            return n;
+    virtual void visit(type_atom *const t) override {
+        key = make_pair(t, 0);
+    }
+
+    virtual void visit(type_struct *const t) override {
+        key = make_pair(t->functor, static_cast<int>(t->args.size()));
+    }
+
+    virtual void visit(type_clause *const t) override {
+        visit(t->head);
+    }
+
+    pair<type_atom*, int> operator() (type_expression *const t) {
+        find(t)->accept(this);
+        return key;
+    }
+};
+
+//----------------------------------------------------------------------------
+// Head Signature: a byte hash of the principal functor at each of eight
+// fixed argument paths, zero where the path holds a variable or does not
+// exist. The paths are the first four arguments, then the first two
+// arguments of each of the first two. A goal cannot unify with a clause
+// head if some byte is non zero in both signatures and differs, so most
+// failing clauses are rejected without a trial unification.
+
+class head_signature : public type_visitor {
+    uint64_t sig;
+    unsigned slot;
+    type_struct *sub; // the structure at the path just visited, or nullptr
+
+    void code(type_atom *const functor, size_t const arity) {
+        uint64_t const h = (reinterpret_cast<uintptr_t>(functor) + arity) * 0x9e3779b97f4a7c15ull;
+        uint64_t const b = h >> 56;
+        sig |= ((b == 0) ? 1 : b) << (8 * slot);
+    }
+
+    void at(unsigned const s, type_expression *const t) {
+        slot = s;
+        sub = nullptr;
+        find(t)->accept(this);
+    }
+
+public:
+    virtual void visit(type_variable *const) override {}
+
+    virtual void visit(type_attrvar *const) override {}
+
+    virtual void visit(type_atom *const t) override {
+        code(t, 0);
+    }
+
+    virtual void visit(type_struct *const t) override {
+        code(t->functor, t->args.size());
+        sub = t;
+    }
+
+    virtual void visit(type_clause *const) override {}
+
+    uint64_t operator() (type_struct *const head) {
+        sig = 0;
+        type_struct *inner[2] = {nullptr, nullptr};
+        for (unsigned k = 0; k < 4 && k < head->args.size(); ++k) {
+            at(k, head->args[k]);
+            if (k < 2) {
+                inner[k] = sub;
+            }
+        }
+        for (unsigned k = 0; k < 2; ++k) {
+            for (unsigned j = 0; inner[k] != nullptr && j < 2 && j < inner[k]->args.size(); ++j) {
+                at(4 + 2 * k + j, inner[k]->args[j]);
+            }
+        }
+        return sig;
+    }
+
+    // false if a byte is set in both and differs.
+    static bool compatible(uint64_t const a, uint64_t const b) {
+        uint64_t const low = 0x7f7f7f7f7f7f7f7full;
+        auto const nonzero = [low](uint64_t const x) {
+            return (((x & low) + low) | x) & ~low;
+        };
+        return (nonzero(a) & nonzero(b) & nonzero(a ^ b)) == 0;
+    }
+};
+
+//----------------------------------------------------------------------------
+// Get Vars - assumes no cycles
+
+class get_variables : public type_visitor {
+    using tvars_type = set<type_variable*>;
+
+    tvars_type tvars;
+
+public:
+    bool constrained; // an attributed variable was found
+
+    virtual void visit(type_variable *const t) override {
+        tvars.insert(t);
+    }
+
+    virtual void visit(type_attrvar *const t) override {
+        tvars.insert(t->var);
+        constrained = true;
+    }
+
+    virtual void visit(type_atom *const t) override {}
+
+    virtual void visit(type_struct *const t) override {
+        for (type_expression *const u : t->args) {
+            find(u)->accept(this);
+        }
+    }
+
+    virtual void visit(type_clause *const t) override {
+        find(t->head)->accept(this);
+        for (type_struct *const u : t->impl) {
+            find(u)->accept(this);
+        }
+    }
+
+    vector<type_expression*> operator() (vector<type_struct *> const ts) {
+        tvars.clear();
+        constrained = false;
+        for (auto const &t : ts) {
+            find(t)->accept(this);
+        }
+        vector<type_expression*> args;
+        args.assign(tvars.begin(), tvars.end());
+        return move(args);
+    }
+};
+
+//----------------------------------------------------------------------------
+// Instantiate Type - assumes no cycles
+
+class type_instantiate : public type_visitor {
+    using tvar_map_type = map<type_variable*, type_variable*>;
+
+    heap& ast;
+    tvar_map_type tvar_map;
+    vector<type_variable*> frame; // fresh variables by slot, while a stored clause is instantiated
+    bool framed;
+    bool numbered; // number fresh variables, for a clause to be stored
+    bool const deep; // copy ground structs too, for terms another thread unifies
+    vector<type_variable*>* repeats; // collects variables seen twice, while numbered
+    vector<type_variable*> pending;
+    type_expression *exp;
+
+    type_struct* inst_struct(type_struct *const t) {
+        if (t->ground && !deep) {
+            return t;
+        }
+        size_t const n = t->args.size();
+        type_expression* small[8];
+        vector<type_expression*> large;
+        type_expression** args = small;
+        if (n > 8) {
+            large.resize(n);
+            args = large.data();
+        }
+        for (size_t i = 0; i < n; ++i) {
+            find(t->args[i])->accept(this);
+            args[i] = exp;
+        }
+        return ast.new_type_struct(t->functor, args, args + n, t->negated);
+    }
+
+    type_variable* inst_var(type_variable *const t) {
+        if (framed) {
+            assert(t->slot >= 0 && static_cast<size_t>(t->slot) < frame.size());
+            type_variable*& n = frame[t->slot];
+            if (n == nullptr) {
+                n = ast.new_type_variable(t->name);
+            }
+            return n;
+        }
+        tvar_map_type::iterator const i = tvar_map.find(t);
+        if (i == tvar_map.end()) { // fresh type variable
+            type_variable *const n = ast.new_type_variable(t->name, numbered ? static_cast<int>(tvar_map.size()) : -1);
+            tvar_map.emplace(t, n);
+            return n;
         } 
+        if (repeats != nullptr && std::find(repeats->cbegin(), repeats->cend(), i->second) == repeats->cend()) {
+            repeats->push_back(i->second);
+        }
         return i->second;
     }
 
-    type_attrvar* inst_attr(type_attrvar* const t) {
-        type_attrvar* const a = ast.new_type_attrvar(inst_var(t->var), inst_struct(t->goal));
-        if (t->next != nullptr) {
-            a->next = inst_attr(t->next);
+    // the constraints usually refer to the attributed variable itself, so
+    // the fresh variable stands in for it until the copy is linked to it.
+    type_expression* inst_attr(type_attrvar* const t) {
+        type_variable *const v = inst_var(t->var);
+        type_expression *const e = find(v);
+        if (e != v || std::find(pending.cbegin(), pending.cend(), v) != pending.cend()) {
+            return e;
         }
-        return a;
+        pending.push_back(v);
+        vector<type_struct*> goals;
+        for (type_attrvar* a = t; a != nullptr; a = a->next) {
+            if (a->goal != nullptr) {
+                goals.push_back(inst_struct(a->goal));
+            }
+        }
+        pending.pop_back();
+        type_attrvar* n = goals.empty() ? ast.new_type_attrvar(v, nullptr) : nullptr;
+        for (auto g = goals.crbegin(); g != goals.crend(); ++g) {
+            n = ast.new_type_attrvar(v, *g, n);
+        }
+        v->bind_fresh(n);
+        return n;
+    }
+
+    // the variables of a stored clause are numbered when it is loaded, so
+    // their fresh copies are found by slot rather than by map lookup.
+    void open_frame(type_clause *const r) {
+        frame.assign(r->vars, nullptr);
+        framed = true;
     }
 
 public:
-    type_clause* inst_rule(
-        type_struct *const h,
-        set<type_variable*> const& c,
-        vector<type_struct*> const& i,
-        int d
-    ) {
-        tvar_map.clear();
-        type_struct *const head = inst_struct(h);
-        set<type_variable*> cyck;
-        for (type_variable *const v : c) {
-            tvar_map_type::const_iterator j = tvar_map.find(v);
-            if (j != tvar_map.end()) {
-                cyck.insert(j->second);
+    // instantiate a stored clause.
+    type_clause* inst_rule(type_clause *const r) {
+        open_frame(r);
+        type_struct *const head = inst_struct(r->head);
+        vector<type_variable*> cyck;
+        for (type_variable *const v : r->cyck) {
+            if (frame[v->slot] != nullptr) {
+                cyck.push_back(frame[v->slot]);
             }
         }
         vector<type_struct*> impl;
-        for (type_struct *const s : i) {
+        for (type_struct *const s : r->impl) {
             impl.push_back(inst_struct(s));
         }
-        return ast.new_type_clause(head, move(cyck), move(impl), d);
+        framed = false;
+        return ast.new_type_clause(head, move(cyck), move(impl), r->id);
+    }
+
+    // instantiate a stored clause without building a clause: the fresh body
+    // is pushed onto next, and the fresh head returned.
+    type_struct* inst_goals(type_clause *const r, goal_list*& next) {
+        open_frame(r);
+        type_struct *const head = inst_struct(r->head);
+        for (auto i = r->impl.crbegin(); i != r->impl.crend(); ++i) {
+            next = ast.new_goal_list(inst_struct(*i), next);
+        }
+        framed = false;
+        return head;
+    }
+
+    // copy a goal into a clause to be stored, an atom is a goal with no
+    // arguments; nullptr if the term is not a goal.
+    type_struct* inst_goal(type_expression *const t) {
+        type_expression *const e = find(t);
+        if (type_struct *const s = dynamic_cast<type_struct*>(e)) {
+            return inst_struct(s);
+        } else if (type_atom *const a = dynamic_cast<type_atom*>(e)) {
+            return ast.new_type_struct(a, vector<type_expression*> {}, false);
+        }
+        return nullptr;
+    }
+
+    // copy a clause built at run time so that it can be stored, numbering
+    // its variables as the parser does and dropping their constraints;
+    // nullptr if a term is not a goal.
+    type_clause* inst_stored(type_expression *const head, vector<type_expression*> const& body, int const id) {
+        tvar_map.clear();
+        numbered = true;
+        vector<type_variable*> cyck;
+        repeats = &cyck;
+        type_struct *const h = inst_goal(head);
+        repeats = nullptr;
+        bool goals = (h != nullptr);
+        vector<type_struct*> impl;
+        for (auto b = body.cbegin(); goals && b != body.cend(); ++b) {
+            impl.push_back(inst_goal(*b));
+            goals = (impl.back() != nullptr);
+        }
+        numbered = false;
+        if (!goals) {
+            return nullptr;
+        }
+        return ast.new_type_clause(h, move(cyck), move(impl), id, tvar_map.size());
     }
 
     virtual void visit(type_variable *const t) override {
         exp = inst_var(t);
     }
 
+    // a stored clause does not keep the constraints of its variables.
     virtual void visit(type_attrvar *const t) override {
-        exp = inst_attr(t);
+        exp = numbered ? inst_var(t->var) : inst_attr(t);
     }
 
     virtual void visit(type_atom *const t) override {
@@ -806,22 +1597,47 @@ public:
     }
 
     virtual void visit(type_clause *const t) override {
-        exp = inst_rule(t->head, t->cyck, t->impl, t->id);
+        type_struct *const head = inst_struct(t->head);
+        vector<type_variable*> cyck;
+        for (type_variable *const v : t->cyck) {
+            tvar_map_type::const_iterator j = tvar_map.find(v);
+            if (j != tvar_map.end()) {
+                cyck.push_back(j->second);
+            }
+        }
+        vector<type_struct*> impl;
+        for (type_struct *const s : t->impl) {
+            impl.push_back(inst_struct(s));
+        }
+        exp = ast.new_type_clause(head, move(cyck), move(impl), t->id);
     }
 
-    explicit type_instantiate(heap& ast) : ast(ast) {}
+    explicit type_instantiate(heap& ast, bool const deep = false)
+        : ast(ast), framed(false), numbered(false), deep(deep), repeats(nullptr) {}
 
     type_expression* operator() (type_expression *const t) {
         tvar_map.clear();
         find(t)->accept(this);
         return exp;
     }
+
+    // instantiate several terms, sharing their variables.
+    vector<type_expression*> operator() (vector<type_expression*> const& ts) {
+        tvar_map.clear();
+        vector<type_expression*> es;
+        for (type_expression *const t : ts) {
+            find(t)->accept(this);
+            es.push_back(exp);
+        }
+        return es;
+    }
 };
 
 //----------------------------------------------------------------------------
 // Cycle Check
 
 class no_cycles : public type_visitor {
+    union_stack& unions;
     set<type_expression*> visited;
     bool cycle_free;
 
@@ -829,7 +1645,7 @@ class no_cycles : public type_visitor {
         pair<set<type_expression*>::const_iterator, bool> p = visited.insert(t);
         if (p.second) { // new element
             for (type_expression *const e : t->args) {
-                find(e)->accept(this);
+                find(e, unions)->accept(this);
             }
             visited.erase(p.first);
         } else {
@@ -852,10 +1668,12 @@ public:
         check_struct(t->head);
     }
     
+    explicit no_cycles(union_stack& unions) : unions(unions) {}
+
     bool operator() (type_expression *const t) {
         visited.clear();
         cycle_free = true;
-        find(t)->accept(this);
+        find(t, unions)->accept(this);
         //if (cycle_free == false) {
         //    cout << "CYCLIC ";
         //}
@@ -939,14 +1757,9 @@ public:
             t2->replace_with(t1, unify.unions);
         }
         virtual void visit(type_attrvar* t2) override {
-            //unify.deferred_goals.push_back(t1);
-            //unify.deferred_goals.push_back(t2);
             link2(t1, t2, unify.unions);
-            type_attrvar* i = t2;
-            while (i->next != nullptr) {
-                i = i->next;
-            }
-            i->next = t1;
+            t2->join(t1);
+            unify.deferred_goals.push_back(t2);
         }
         virtual void visit(type_atom *const t2) override {
             unify.deferred_goals.push_back(t1);
@@ -1075,15 +1888,15 @@ public:
         rule(u1);
     }
 
-    explicit trail() : variable(*this), attrvar(*this), atom(*this), strct(*this),
+    explicit trail() : nocyc(unions), variable(*this), attrvar(*this), atom(*this), strct(*this),
         rule(*this) {}
 
 private:
     void unify() { // set unifies to true first.
         while (todo.size() > 0 && unifies) {
             texp_pair const &tt = todo.back();
-            type_expression *const u1 = find(tt.first);
-            u2 = find(tt.second);
+            type_expression *const u1 = find(tt.first, unions);
+            u2 = find(tt.second, unions);
             todo.pop_back();
             if (u1 != u2) {
                 u1->accept(this);
@@ -1110,36 +1923,54 @@ public:
         return unifies && nocyc(x) && nocyc(y);
     }
 
-    bool unify_goal_rule(type_struct *const g, type_clause *const r) {
+    // unify the arguments of a goal with atoms, which cannot make cycles.
+    bool unify_goal_atoms(type_struct *const g, type_atom *const *const values) {
+        deferred_goals.clear();
+        todo.clear();
+        unifies = true;
+        for (size_t k = 0; k < g->args.size(); ++k) {
+            queue(g->args[k], values[k]);
+        }
+        unify();
+        return unifies;
+    }
+
+    // unify a goal with a fresh rule head, without the cycle check of the
+    // rule, for heads already known to match.
+    bool unify_goal_head(type_struct *const g, type_struct *const h) {
         deferred_goals.clear();
         todo.clear();
         unifies = true;
 
-        struct_struct(g, r->head);
+        struct_struct(g, h);
+
+        if (unifies) {
+            unify();
+        }
+        return unifies;
+    }
 
+    bool unify_goal_rule(type_struct *const g, type_clause *const r) {
         /*type_show ts;
         ts(g);
         cout << " <U> ";
         ts(r);
         cout << endl;*/
 
-        if (unifies) {
-            unify();
-            if (unifies) {
-                for (type_variable *const v : r->cyck) {
-                    if (!nocyc(v)) {
-                        return false;
-                    }
+        if (unify_goal_head(g, r->head)) {
+            for (type_variable *const v : r->cyck) {
+                if (!nocyc(v)) {
+                    return false;
                 }
+            }
 
-                /*cout << " = ";
-                ts(g); 
-                cout << " <U> ";
-                ts(r);
-                cout << "\n\n";*/
+            /*cout << " = ";
+            ts(g); 
+            cout << " <U> ";
+            ts(r);
+            cout << "\n\n";*/
 
-                return true;
-            }
+            return true;
         }
 
         return false;
@@ -1149,10 +1980,16 @@ public:
         return unions.size();
     }
 
+    // the bytes reserved by the trail and the unification work lists.
+    size_t bytes() const {
+        return unions.capacity() * sizeof(union_entry) + todo.capacity() * sizeof(texp_pair)
+            + deferred_goals.capacity() * sizeof(type_attrvar*);
+    }
+
     void backtrack(int const p) {
         while(unions.size() > p) {
-            pair<type_expression *const, bool const> &u = unions.back();
-            u.first->deunion(u.second);
+            union_entry const &u = unions.back();
+            u.node->deunion(u.prev, u.ranked);
             unions.pop_back();
         }
     }
@@ -1173,15 +2010,21 @@ public:
 //----------------------------------------------------------------------------
 // Rational Tree Disunification: only result, no variables unified.
 
+// All pairs are compared, so one different pair is found even after an
+// undecided one, and the undecided pairs are kept as the residual, so
+// that a woken constraint resumes from them rather than the whole terms.
+
 struct disunify : public type_visitor {
     enum result {different, same, variable_deferred, attrvar_deferred} result;
     vector<type_attrvar*> deferred_goals;
     type_variable* defer_variable;
     type_attrvar* defer_attrvar;
 
-private:
     using texp_pair = pair<type_expression*, type_expression*>;
+
+private:
     vector<texp_pair> todo;
+    vector<texp_pair> residual;
     type_expression *u2;
 
     inline void queue(type_expression *const t1, type_expression *const t2) {
@@ -1241,25 +2084,45 @@ private:
     } struct_disunify;
 
     enum result du() {
-        result = same;
+        enum result deferred = same;
+        type_variable* first_variable = nullptr;
+        type_attrvar* first_attrvar = nullptr;
+        residual.clear();
 
-        while ((todo.size() > 0) && (result == same)) {
+        while (todo.size() > 0) {
             texp_pair const &tt = todo.back();
             type_expression *const u1 = find(tt.first);
             u2 = find(tt.second);
             todo.pop_back();
 
-            type_show ts;
-            ts(u1);
-            cout << " <> ";
-            ts(u2);
-            cout << "\n";
+            IF_DEBUG(
+                type_show ts;
+                ts(u1);
+                cout << " <> ";
+                ts(u2);
+                cout << "\n";
+            )
 
             if (u1 != u2) {
+                result = same;
                 u1->accept(this);
+                if (result == different) {
+                    return result;
+                } else if (result != same) {
+                    residual.emplace_back(u1, u2);
+                    if (deferred == same) {
+                        deferred = result;
+                        first_variable = defer_variable;
+                        first_attrvar = defer_attrvar;
+                    }
+                }
             }
         }
 
+        // defer on the first undecided pair.
+        result = deferred;
+        defer_variable = first_variable;
+        defer_attrvar = first_attrvar;
         return result;
     }
 
@@ -1276,11 +2139,13 @@ public:
         todo.clear();
         todo.push_back(make_pair(x, y));
 
-        type_show ts;
-        ts(x);
-        cout << " <D> ";
-        ts(y);
-        cout << "\n";
+        IF_DEBUG(
+            type_show ts;
+            ts(x);
+            cout << " <D> ";
+            ts(y);
+            cout << "\n";
+        )
 
         return du();
     }
@@ -1292,96 +2157,803 @@ public:
     type_attrvar* get_deferred_attrvar() {
         return defer_attrvar;
     }
-};
-
-//----------------------------------------------------------------------------
-// Unfolding:
-// (A0 :- A1, A2,..., An) (+) (B0 :- B1, B2,..., Bm) = mgu(A1, B0) * (A0 :- B1,..., Bm, A2,..., An)
 
-struct context {
-    atoms &names;
-    env_type &env;
-    heap ast;
-    trail unify;
-    type_instantiate inst;
+    // the pairs still undecided when the result is deferred.
+    vector<texp_pair> const& get_residual() {
+        return residual;
+    }
 
-    context(atoms &names, env_type &env)
-        : names(names), env(env), inst(ast) {}
-    context(const context&) = default;
-    context& operator=(const context&) = default;
+    size_t bytes() const {
+        return (todo.capacity() + residual.capacity()) * sizeof(texp_pair)
+            + deferred_goals.capacity() * sizeof(type_attrvar*);
+    }
 };
 
-class unfolder {
-    static vector<type_clause*> const invalid;
-
-    context &cxt;
-    type_clause *fresh;
-    vector<type_clause*>::const_iterator begin;
-    vector<type_clause*>::const_iterator end;
-    int const trail_checkpoint;
-    int const env_checkpoint;
-    enum builtin {not_builtin, builtin_dif, builtin_duplicate_term} builtin;
-
-public:
-    type_clause *goal;
-    int const depth;
-
-    unfolder(const unfolder&) = delete;
-    unfolder(unfolder&&) = default;
-    unfolder& operator= (const unfolder&) = delete;
-
-    unfolder(context &cxt, type_clause *g, int d)
-    : cxt(cxt)
-    , goal(g)
-    , trail_checkpoint(cxt.unify.checkpoint())
-    , env_checkpoint(cxt.ast.checkpoint())
-    , builtin(not_builtin)
-    , depth(d) {
-        type_struct *first = goal->impl.front();
-        env_type::iterator i = cxt.env.find(first->functor);
-        if (i != cxt.env.end()) {
-            begin = i->second.cbegin();
-            end = i->second.cend();
+//----------------------------------------------------------------------------
+// Database Updates: assert appends a clause, retract stamps it dead, see
+// env_type.
+
+void predicate::add(type_clause *const c, principal& functor_of) {
+    unsigned const end = size() + 1;
+    push_back(c);
+    c->signature = head_signature()(c->head);
+    if (modes.size() < c->head->args.size()) {
+        modes.resize(c->head->args.size());
+    }
+    for (size_t k = 0; k < c->head->args.size(); ++k) {
+        pair<type_atom*, int> const key = functor_of(c->head->args[k]);
+        if (key.first == nullptr) {
+            modes[k].open = end;
         } else {
-            end = invalid.cend();
-            begin = end;
+            modes[k].last[key] = end;
+        }
+    }
+}
+
+void predicate::reindex(principal& functor_of) {
+    vector<type_clause*> clauses;
+    clauses.swap(*this);
+    modes.clear();
+    for (type_clause *const c : clauses) {
+        add(c, functor_of);
+    }
+}
 
-            if (first->functor->value == "dif" && first->args.size() == 2) {
-                builtin = builtin_dif;
-            } else if (first->functor->value == "duplicate_term" && first->args.size() == 2) {
-                builtin = builtin_duplicate_term;
+// an argument with a variable in the last clause cannot narrow the call,
+// so the functor of the goal's argument is only found when it might.
+unsigned predicate::last_match(type_struct *const g, principal& functor_of) const {
+    unsigned end = size();
+    for (size_t k = 0; k < g->args.size() && k < modes.size() && end != 0; ++k) {
+        argument const& a = modes[k];
+        if (a.open < end) {
+            pair<type_atom*, int> const key = functor_of(g->args[k]);
+            if (key.first != nullptr) {
+                auto const i = a.last.find(key);
+                end = max(a.open, (i == a.last.cend()) ? 0 : min(end, i->second));
             }
         }
     }
+    return end;
+}
 
-    type_clause* get() {
-        cxt.unify.backtrack(trail_checkpoint);
-        cxt.ast.backtrack(env_checkpoint);
-        type_struct *const first = goal->impl.front();
+// the atom named by a string, made if it is new.
+type_atom* intern(atoms& names, heap& h, string const& a) {
+    auto const i = names.find(a);
+    if (i == names.end()) {
+        type_atom *t = h.new_type_atom(a);
+        names.insert(make_pair(a, t));
+        return t;
+    }
+    return i->second;
+}
 
-        //if (first->negated) { //need to swap goal-list and or stack for negated part
-            //cout << "NEGATED" << endl;
+type_atom* fact_table::atom(uint32_t const id, atoms& names, heap& h) {
+    if (made[id] == nullptr) {
+        made[id] = detail::intern(names, h, pool.substr(begin(id), ends[id] - begin(id)));
+    }
+    return made[id];
+}
 
-            // -((a & b & c) | (d & e & f) | (g & h & i))
-            // (-(a & b & c) & -(d & e & f) & -(g & h & i))
-            // ((-a | -b | -c) & (-d | -e | -f) & (-g | -h | -i))
+bool visible(type_clause const *const c, unsigned const generation) {
+    return c->born <= generation && generation < c->died;
+}
 
-            // ((a | b | c) & (d | e | f) & (g | h | i)
-            // (-(-a & -b & -c) & (-d & -e & -f) & (-g & -h & -i))
-            // -((-a & -b & -c) | (-d & -e & -f) | (-g & -h & -i)
-            // try each goal:
+void add_clause(env_type& env, type_clause *const c) {
+    c->born = ++env.generation;
+    principal functor_of;
+    env[c->head->functor].add(c, functor_of);
+}
 
-            /*while (begin != end) {
-                type_clause* clause = *(begin++);
-                if (cxt.unify.match_goal_rule(first, clause)) {
-                    fresh = cxt.inst.inst_rule(clause->head, clause->cyck, clause->impl, clause->id);
-                    cxt.unify.unify_goal_rule(first, fresh);
+// remove the dead clauses, only when no solver is running. Positions move,
+// so the generation is advanced for copies of the clauses to be made again.
+void collect(env_type& env) {
+    if (!env.dirty.empty()) {
+        ++env.generation;
+    }
+    principal functor_of;
+    for (type_atom *const f : env.dirty) {
+        predicate& p = env[f];
+        p.erase(remove_if(p.begin(), p.end(), [](type_clause const *const c) {
+            return c->died != numeric_limits<unsigned>::max();
+        }), p.end());
+        p.reindex(functor_of);
+    }
+    env.dirty.clear();
+}
 
+void remove_clause(env_type& env, type_clause *const c) {
+    c->died = ++env.generation;
+    env.dirty.insert(c->head->functor);
+    if (env.running == 0) {
+        collect(env);
+    }
+}
 
+//----------------------------------------------------------------------------
+// Clause Profile: how often each clause is resolved with, and how often it
+// is part of a proof, per call pattern (the set of bound goal arguments).
+// Candidate clauses are tried in order of their estimated chance of leading
+// to a proof. Unfolders iterate over the ordered lists, so they are only
+// reordered between queries, asserted clauses are appended. The profile is saved as text keyed by functor,
+// arity and clause id, so it only applies to the program it was made from.
+
+class clause_profile {
+    struct counts {
+        uint64_t tried;
+        uint64_t proved;
+
+        counts() : tried(0), proved(0) {}
+    };
 
-                switch( dis.exp_exp(first, fresh->head)) {
-                    case disunify::same:
-                        return nullptr;
+    using call = pair<type_atom*, unsigned>;
+
+    map<pair<int, unsigned>, counts> stats;
+    map<call, predicate> ordered; // without mode indexes
+    uint64_t program; // the key of this program's entries, see key
+    vector<string> others; // entries of other programs, saved unchanged
+
+    // Laplace estimate, an unseen clause scores a half.
+    double score(int const id, unsigned const pattern) const {
+        auto const i = stats.find(make_pair(id, pattern));
+        if (i == stats.cend()) {
+            return 0.5;
+        }
+        return (i->second.proved + 1.0) / (i->second.tried + 2.0);
+    }
+
+    // stable, so clauses with equal scores stay in source order.
+    void order(unsigned const pattern, vector<type_clause*>& clauses) const {
+        vector<pair<double, type_clause*>> scored;
+        for (type_clause *const c : clauses) {
+            scored.emplace_back(score(c->id, pattern), c);
+        }
+        stable_sort(scored.begin(), scored.end(), [](pair<double, type_clause*> const& a, pair<double, type_clause*> const& b) {
+            return a.first > b.first;
+        });
+        for (size_t i = 0; i < scored.size(); ++i) {
+            clauses[i] = scored[i].second;
+        }
+    }
+
+    static map<int, type_clause*> index(env_type const& env) {
+        map<int, type_clause*> by_id;
+        for (auto const& fun : env) {
+            for (type_clause *const c : fun.second) {
+                by_id.emplace(c->id, c);
+            }
+        }
+        return by_id;
+    }
+
+    // FNV-1a over the names in a clause as it is written, atoms and
+    // variables by name, so it is the same each time the text is loaded.
+    class text_hash : public type_visitor {
+        void add(string const& s, char const end) {
+            for (char const c : s) {
+                h = (h ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+            }
+            h = (h ^ static_cast<unsigned char>(end)) * 1099511628211ull;
+        }
+
+    public:
+        uint64_t h = 14695981039346656037ull;
+
+        virtual void visit(type_variable *const t) override {
+            add(t->name, ' ');
+        }
+
+        virtual void visit(type_attrvar *const t) override {
+            add(t->var->name, ' ');
+        }
+
+        virtual void visit(type_atom *const t) override {
+            add(t->value, ' ');
+        }
+
+        virtual void visit(type_struct *const t) override {
+            add(t->negated ? "-" + t->functor->value : t->functor->value, '(');
+            for (type_expression *const e : t->args) {
+                find(e)->accept(this);
+            }
+            add("", ')');
+        }
+
+        virtual void visit(type_clause *const t) override {
+            if (t->head != nullptr) {
+                visit(t->head);
+            }
+            for (type_struct *const s : t->impl) {
+                visit(s);
+            }
+            add("", '.');
+        }
+    };
+
+    // a hash of the text of the program's clauses in clause order, so the
+    // counts of one program are not used for another.
+    static uint64_t key(env_type const& env) {
+        text_hash th;
+        for (auto const& c : index(env)) {
+            th.visit(c.second);
+        }
+        return th.h;
+    }
+
+public:
+    clause_profile() : program(0) {}
+
+    // the candidate clauses for a call, ordered when first seen. A fact
+    // table is shared with the predicate, its rows are not reordered.
+    predicate const& candidates(type_atom *const functor, unsigned const pattern
+    , predicate const& clauses) {
+        call const c(functor, pattern);
+        auto i = ordered.find(c);
+        if (i == ordered.end()) {
+            i = ordered.emplace(c, predicate {}).first;
+            i->second.assign(clauses.cbegin(), clauses.cend());
+            i->second.table = clauses.table;
+            order(pattern, i->second);
+        }
+        return i->second;
+    }
+
+    void tried(int const id, unsigned const pattern) {
+        ++stats[make_pair(id, pattern)].tried;
+    }
+
+    void proved(int const id, unsigned const pattern) {
+        ++stats[make_pair(id, pattern)].proved;
+    }
+
+    // an asserted clause is appended to the lists of its predicate, so
+    // running unfolders stay valid.
+    void added(type_clause *const c) {
+        for (auto i = ordered.lower_bound(call(c->head->functor, 0))
+            ; i != ordered.end() && i->first.first == c->head->functor; ++i) {
+            i->second.push_back(c);
+        }
+    }
+
+    // must not be called while a solver is running, drops retracted clauses.
+    void reorder() {
+        for (auto& o : ordered) {
+            o.second.erase(remove_if(o.second.begin(), o.second.end(), [](type_clause const *const c) {
+                return c->died != numeric_limits<unsigned>::max();
+            }), o.second.end());
+            order(o.first.second, o.second);
+        }
+    }
+
+    // entries are keyed by program, those of other programs are kept
+    // aside and saved again, so one file can hold the profiles of several.
+    void load(istream& in, env_type const& env) {
+        program = key(env);
+        uint64_t k;
+        string functor;
+        size_t arity;
+        int id;
+        unsigned pattern;
+        counts n;
+        while (in >> k >> functor >> arity >> id >> pattern >> n.tried >> n.proved) {
+            if (k == program) {
+                stats[make_pair(id, pattern)] = n;
+            } else {
+                others.push_back(to_string(k) + " " + functor + " " + to_string(arity) + " " + to_string(id)
+                    + " " + to_string(pattern) + " " + to_string(n.tried) + " " + to_string(n.proved));
+            }
+        }
+    }
+
+    void save(ostream& out, env_type const& env) const {
+        map<int, type_clause*> const by_id = index(env);
+        for (auto const& s : stats) {
+            auto const i = by_id.find(s.first.first);
+            if (i != by_id.cend()) {
+                out << program << " " << i->second->head->functor->value << " " << i->second->head->args.size()
+                    << " " << s.first.first << " " << s.first.second
+                    << " " << s.second.tried << " " << s.second.proved << "\n";
+            }
+        }
+        for (string const& o : others) {
+            out << o << "\n";
+        }
+    }
+};
+
+//----------------------------------------------------------------------------
+// Independent AND-Parallelism: when the first two goals of a resolvent share
+// no variables and have no constraints, the solutions of the second do not
+// depend on how the first is solved. The second is then solved on a worker
+// thread while the solver works on the first, and when the solver reaches
+// it the worker's solutions are replayed in order, step by step. Unifying
+// links the nodes of both terms, so a worker solves over its own copy of
+// the clauses, and only atoms are shared.
+
+// two goals are independent when neither is constrained and they share no
+// variables, so solving one can neither bind nor wake the other.
+bool independent(type_struct *const a, type_struct *const b) {
+    is_ground ground;
+    if (ground(b) == is_ground::none) {
+        return true;
+    }
+    get_variables gv;
+    vector<type_expression*> const vb = gv(vector<type_struct*> {b});
+    if (gv.constrained) {
+        return false;
+    }
+    if (ground(a) == is_ground::none) {
+        return true;
+    }
+    vector<type_expression*> const va = gv(vector<type_struct*> {a});
+    if (gv.constrained) {
+        return false;
+    }
+    set<type_expression*> const shared(va.cbegin(), va.cend());
+    for (type_expression *const v : vb) {
+        if (shared.count(v) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// a goal handed to a worker, and the solutions the worker has published.
+// A solution is the position of the clause taken at each step, so the
+// solver replays it on its own frames, resolving with the same clauses as
+// a search would. Printed variables are numbered by node, and the nodes
+// are allocated differently, so they may be renamed. The worker searches within the depth bound left
+// at the least or-stack size the goal could be reached at; each solution
+// records the least depth it needs, so the solver can keep just the
+// solutions a sequential search would find from where it reaches the goal.
+struct and_job {
+    struct solution {
+        vector<unsigned> path; // the position of each step, see unfolder::position
+        int need; // the largest frames plus goals of any step that was checked against the bound
+    };
+
+    static size_t const window = 64; // solutions the worker may find ahead of the solver
+
+    goal_list *const goals; // the resolvent the goal starts, in the solver's heap
+    int const rest; // the goals after it
+    int const limit; // the most frames plus goals the worker lets a step have
+    unsigned const generation; // of the clauses the worker solves over
+    size_t const height; // the or-stack size when the job was made
+    heap terms; // the worker's copy of the goal
+    type_struct *goal;
+    size_t cursor; // the next solution to replay
+
+    mutex lock;
+    condition_variable ready;
+    deque<solution> solutions; // references stay valid as it grows
+    size_t taken; // solutions the solver has asked for
+    bool done;
+    atomic<bool> cancel;
+
+    and_job(goal_list *const goals, int const limit, unsigned const generation, size_t const height)
+        : goals(goals), rest((goals->next == nullptr) ? 0 : goals->next->size), limit(limit)
+        , generation(generation), height(height), goal(nullptr), cursor(0), taken(0), done(false), cancel(false) {}
+
+    // the worker must be finished with a job before it is freed.
+    ~and_job() {
+        unique_lock<mutex> l(lock);
+        cancel = true;
+        ready.notify_all();
+        ready.wait(l, [this]() {return done;});
+    }
+
+    // add a solution, waiting while the worker is a window ahead.
+    void publish(solution&& s) {
+        {
+            unique_lock<mutex> l(lock);
+            ready.wait(l, [this]() {return solutions.size() < taken + window || cancel;});
+            solutions.push_back(move(s));
+        }
+        ready.notify_all();
+    }
+
+    // notifies under the lock: once done is seen the job may be freed.
+    void finish() {
+        lock_guard<mutex> const l(lock);
+        done = true;
+        ready.notify_all();
+    }
+
+    // the i-th solution, waiting for the worker to find it; nullptr if
+    // there are no more.
+    solution const* wait(size_t const i) {
+        unique_lock<mutex> l(lock);
+        if (i + 1 > taken) {
+            taken = i + 1;
+            ready.notify_all();
+        }
+        ready.wait(l, [this, i]() {return i < solutions.size() || done;});
+        return (i < solutions.size()) ? &solutions[i] : nullptr;
+    }
+};
+
+//----------------------------------------------------------------------------
+// Unfolding:
+// (A0 :- A1, A2,..., An) (+) (B0 :- B1, B2,..., Bm) = mgu(A1, B0) * (A0 :- B1,..., Bm, A2,..., An)
+
+struct context {
+    atoms &names;
+    env_type &env;
+    heap ast;
+    trail unify;
+    type_instantiate inst;
+    disunify dif;
+    principal functor_of;
+    clause_profile *const profile; // nullptr unless clause ordering is adaptive
+    bool const proofs; // keep the instantiated clause of each step
+    type_atom *const tuple;
+    unsigned wake_stamp;
+    vector<unique_ptr<and_job>> jobs; // innermost last
+    vector<unsigned> script; // the positions of the steps being replayed, last first
+    int room; // the depth bound less the or-stack size, set before each resolution
+
+    context(atoms &names, env_type &env, clause_profile *const profile = nullptr, bool const proofs = true)
+        : names(names), env(env), inst(ast), profile(profile), proofs(proofs)
+        , tuple(ast.new_type_atom("")), wake_stamp(0), room(0) {}
+    context(const context&) = delete;
+    context& operator=(const context&) = delete;
+
+    // the job solving the first goal of a resolvent, or nullptr.
+    and_job* joined(goal_list *const goals) const {
+        for (auto i = jobs.crbegin(); i != jobs.crend(); ++i) {
+            if ((*i)->goals == goals) {
+                return i->get();
+            }
+        }
+        return nullptr;
+    }
+};
+
+// A choice point, held by value on the solver's or-stack, so it is kept
+// minimal: the context is passed in rather than referenced from each frame.
+// Candidates are held by index, as asserting may grow the clause list, and
+// only the clauses visible at the generation of the call are tried. The
+// rows of a fact table are numbered before the clauses.
+
+class unfolder {
+    static predicate const invalid;
+
+    type_clause *fresh;
+    predicate const* clauses;
+    unsigned index;
+    unsigned end;
+
+public:
+    goal_list *const goals;
+
+private:
+    int const trail_checkpoint;
+    int const env_checkpoint;
+    unsigned const generation;
+    uint16_t pattern; // the bound arguments of the goal, when profiling
+    enum builtin : uint8_t {not_builtin, builtin_dif, builtin_duplicate_term, builtin_assert, builtin_retract
+        , builtin_joined} builtin;
+
+    static uint16_t call_pattern(context &cxt, type_struct *const g) {
+        uint16_t p = 0;
+        for (size_t i = 0; i < g->args.size() && i < 16; ++i) {
+            if (cxt.functor_of(g->args[i]).first != nullptr) {
+                p |= 1u << i;
+            }
+        }
+        return p;
+    }
+
+    // the disequality over the undecided pairs, the pairs are gathered into
+    // tuples when there is more than one.
+    type_struct* residual(context &cxt, type_struct *const g) {
+        vector<disunify::texp_pair> const& r = cxt.dif.get_residual();
+        if (r.size() == 1) {
+            if (r[0].first == find(g->args[0]) && r[0].second == find(g->args[1])) {
+                return g;
+            }
+            return cxt.ast.new_type_struct(g->functor
+                , vector<type_expression*> {r[0].first, r[0].second}, false);
+        }
+        vector<type_expression*> lhs;
+        vector<type_expression*> rhs;
+        for (auto const& p : r) {
+            lhs.push_back(p.first);
+            rhs.push_back(p.second);
+        }
+        return cxt.ast.new_type_struct(g->functor, vector<type_expression*> {
+            cxt.ast.new_type_struct(cxt.tuple, move(lhs), false),
+            cxt.ast.new_type_struct(cxt.tuple, move(rhs), false)
+        }, false);
+    }
+
+    // check a disequality, suspending its residual on the variable
+    // disunification deferred on, unless that is the attributed variable
+    // already watching it.
+    enum disunify::result constrain(context &cxt, type_struct *&g, type_attrvar *const watch) {
+        enum disunify::result const r = cxt.dif.exp_exp(g->args[0], g->args[1]);
+        if (r == disunify::variable_deferred || r == disunify::attrvar_deferred) {
+            g = residual(cxt, g);
+        }
+        switch (r) {
+            case disunify::variable_deferred: {
+                type_variable* const defvar = cxt.dif.get_deferred_variable();
+                defvar->replace_with(cxt.ast.new_type_attrvar(defvar, g), cxt.unify.unions);
+                IF_DEBUG(
+                    cout << "FREEZE ";
+                    type_show ts;
+                    ts(g);
+                    cout << endl;
+                );
+                break;
+            }
+            case disunify::attrvar_deferred: {
+                type_attrvar* const defatr = cxt.dif.get_deferred_attrvar();
+                if (defatr != watch) {
+                    defatr->replace_with(cxt.ast.new_type_attrvar(defatr->var, g, defatr), cxt.unify.unions);
+                    IF_DEBUG(
+                        cout << "FREEZE+ ";
+                        type_show ts;
+                        ts(g);
+                        cout << endl;
+                    );
+                }
+                break;
+            }
+            default:
+                break;
+        }
+        return r;
+    }
+
+    // wake the constraints of the attributed variables bound by the last
+    // unification: a violated constraint fails, an entailed one is dropped,
+    // and the rest are suspended again. An attributed variable that is still
+    // unbound is rebuilt with only the constraints it still watches.
+    bool thaw(context &cxt) {
+        vector<type_attrvar*> const& d = cxt.unify.get_deferred_goals();
+        IF_DEBUG(cout << "deferred goals: " << d.size() << endl;)
+        if (d.empty()) {
+            return true;
+        }
+        unsigned const stamp = ++cxt.wake_stamp;
+        for (type_attrvar *const h : d) {
+            type_attrvar *const watch = dynamic_cast<type_attrvar*>(find(h, cxt.unify.unions));
+            vector<type_struct*> kept;
+            bool changed = false;
+            for (type_attrvar* a = (watch != nullptr) ? watch : h; a != nullptr; a = a->next) {
+                if (a->goal == nullptr) {
+                    continue;
+                } else if (a->woken == stamp) {
+                    if (watch != nullptr) {
+                        kept.push_back(a->goal);
+                    }
+                    continue;
+                }
+                a->woken = stamp;
+                IF_DEBUG(
+                    cout << "THAW ";
+                    type_show ts;
+                    ts(a->goal);
+                    cout << endl;
+                );
+                type_struct* g = a->goal;
+                switch (constrain(cxt, g, watch)) {
+                    case disunify::same:
+                        return false;
+                    case disunify::attrvar_deferred:
+                        if (cxt.dif.get_deferred_attrvar() == watch) {
+                            kept.push_back(g);
+                            changed = changed || (g != a->goal);
+                        } else {
+                            changed = true;
+                        }
+                        break;
+                    default:
+                        changed = true;
+                        break;
+                }
+            }
+            if (watch != nullptr && changed) {
+                type_attrvar* n = kept.empty() ? cxt.ast.new_type_attrvar(watch->var, nullptr) : nullptr;
+                for (auto g = kept.crbegin(); g != kept.crend(); ++g) {
+                    n = cxt.ast.new_type_attrvar(watch->var, *g, n);
+                    n->woken = stamp;
+                }
+                watch->replace_with(n, cxt.unify.unions);
+            }
+        }
+        return true;
+    }
+
+    // resolve with the next row of the table that matches the goal. The
+    // bound arguments are compared by atom id, so rows are only read, and
+    // the unbound ones are then unified with the row's atoms.
+    bool resolve_row(context &cxt, type_struct *const first, fact_table& table, goal_list*& next) {
+        size_t const arity = first->args.size();
+        unsigned bound[fact_table::max_arity];
+        uint32_t ids[fact_table::max_arity];
+        unsigned n = 0;
+        bool matches = (arity == table.arity);
+        for (size_t k = 0; matches && k < arity; ++k) {
+            pair<type_atom*, int> const key = cxt.functor_of(first->args[k]);
+            if (key.first != nullptr) {
+                matches = (key.second == 0 && table.find(key.first->value, ids[n]));
+                bound[n++] = k;
+            }
+        }
+        if (!matches) {
+            index = table.rows;
+            return false;
+        }
+        type_atom* values[fact_table::max_arity];
+        while ((index = table.scan(index, bound, ids, n)) < table.rows) {
+            unsigned const row = index++;
+            for (size_t k = 0; k < arity; ++k) {
+                values[k] = table.atom(table.columns[k][row], cxt.names, *cxt.env.store);
+            }
+            if (cxt.unify.unify_goal_atoms(first, values) && thaw(cxt)) {
+                if (cxt.proofs) {
+                    fresh = cxt.ast.new_type_clause(cxt.ast.new_type_struct(first->functor, values, values + arity, false));
+                }
+                next = goals->next;
+                return true;
+            }
+            cxt.unify.backtrack(trail_checkpoint);
+            cxt.ast.backtrack(env_checkpoint);
+        }
+        return false;
+    }
+
+    // take the next solution of a goal solved by a worker that a sequential
+    // search would find within the room left: the frame tries just the
+    // clause of its first step, and the frames pushed after it replay the
+    // rest. False when there are no more.
+    bool join(context &cxt, and_job& job) {
+        while (and_job::solution const *const s = job.wait(job.cursor++)) {
+            if (s->need + job.rest <= cxt.room + 1) {
+                end = s->path[0];
+                index = end - 1;
+                cxt.script.assign(s->path.crbegin(), s->path.crend() - 1);
+                return true;
+            }
+        }
+        builtin = not_builtin;
+        index = end;
+        return false;
+    }
+
+    // assert(Head, Goal...) appends the clause Head :- Goal... to the
+    // database; calls already made do not see it.
+    bool assert_clause(context &cxt, type_struct *const g) {
+        type_instantiate keep(*cxt.env.store);
+        type_clause *const c = keep.inst_stored(g->args[0]
+            , vector<type_expression*>(g->args.cbegin() + 1, g->args.cend()), ++cxt.env.last_id);
+        if (c == nullptr) {
+            return false;
+        }
+        mark_ground ground;
+        ground(c);
+        add_clause(cxt.env, c);
+        if (cxt.profile != nullptr) {
+            cxt.profile->added(c);
+        }
+        return true;
+    }
+
+    // retract(Head) removes the first clause visible to this call whose
+    // head unifies with Head, binding it; calls already made still see it.
+    bool retract_clause(context &cxt, type_struct *const g) {
+        type_expression *const e = find(g->args[0]);
+        type_struct *h = dynamic_cast<type_struct*>(e);
+        if (type_atom *const a = dynamic_cast<type_atom*>(e)) {
+            h = cxt.ast.new_type_struct(a, vector<type_expression*> {}, false);
+        }
+        env_type::iterator const i = (h != nullptr) ? cxt.env.find(h->functor) : cxt.env.end();
+        if (i == cxt.env.end()) {
+            return false;
+        }
+        uint64_t const sig = head_signature()(h);
+        for (type_clause *const c : i->second) {
+            if (visible(c, generation) && head_signature::compatible(sig, c->signature)
+                && cxt.unify.match_goal_rule(h, c)) {
+                goal_list *body = nullptr;
+                cxt.unify.unify_goal_head(h, cxt.inst.inst_goals(c, body));
+                if (thaw(cxt)) {
+                    remove_clause(cxt.env, c);
+                    return true;
+                }
+                cxt.unify.backtrack(trail_checkpoint);
+                cxt.ast.backtrack(env_checkpoint);
+            }
+        }
+        return false;
+    }
+
+public:
+    unfolder(const unfolder&) = delete;
+    unfolder(unfolder&&) = default;
+    unfolder& operator= (const unfolder&) = delete;
+
+    unfolder(context &cxt, goal_list *g)
+    : fresh(nullptr)
+    , clauses(&invalid)
+    , index(0)
+    , end(0)
+    , goals(g)
+    , trail_checkpoint(cxt.unify.checkpoint())
+    , env_checkpoint(cxt.ast.checkpoint())
+    , generation(cxt.env.generation)
+    , pattern(0)
+    , builtin(not_builtin) {
+        type_struct *first = goals->goal;
+        env_type::iterator i = cxt.env.find(first->functor);
+        if (i != cxt.env.end()) {
+            clauses = &(i->second);
+            if (cxt.profile != nullptr) {
+                pattern = call_pattern(cxt, first);
+                clauses = &(cxt.profile->candidates(first->functor, pattern, i->second));
+                end = clauses->size();
+            } else {
+                end = i->second.last_match(first, cxt.functor_of);
+            }
+            if (clauses->table != nullptr) {
+                end += clauses->table->rows;
+            }
+        } else if (first->functor->value == "dif" && first->args.size() == 2) {
+            builtin = builtin_dif;
+        } else if (first->functor->value == "duplicate_term" && first->args.size() == 2) {
+            builtin = builtin_duplicate_term;
+        } else if (first->functor->value == "assert" && first->args.size() >= 1) {
+            builtin = builtin_assert;
+        } else if (first->functor->value == "retract" && first->args.size() == 1) {
+            builtin = builtin_retract;
+        }
+        if (!cxt.script.empty()) {
+            // a step of a worker's solution: try just the candidate it took.
+            end = cxt.script.back();
+            index = (end > 0) ? end - 1 : 0;
+            cxt.script.pop_back();
+        } else if (!cxt.jobs.empty() && builtin == not_builtin) {
+            and_job *const job = cxt.joined(goals);
+            if (job != nullptr && job->generation == cxt.env.generation) {
+                builtin = builtin_joined;
+                job->cursor = 0;
+            }
+        }
+    }
+
+    // on success set next to the new resolvent (nullptr when empty) and return true.
+    bool get(context &cxt, goal_list*& next) {
+        cxt.unify.backtrack(trail_checkpoint);
+        cxt.ast.backtrack(env_checkpoint);
+        type_struct *const first = goals->goal;
+        if (builtin == builtin_joined && !join(cxt, *cxt.joined(goals))) {
+            return false;
+        }
+
+        //if (first->negated) { //need to swap goal-list and or stack for negated part
+            //cout << "NEGATED" << endl;
+
+            // -((a & b & c) | (d & e & f) | (g & h & i))
+            // (-(a & b & c) & -(d & e & f) & -(g & h & i))
+            // ((-a | -b | -c) & (-d | -e | -f) & (-g | -h | -i))
+
+            // ((a | b | c) & (d | e | f) & (g | h | i)
+            // (-(-a & -b & -c) & (-d & -e & -f) & (-g & -h & -i))
+            // -((-a & -b & -c) | (-d & -e & -f) | (-g & -h & -i)
+            // try each goal:
+
+            /*while (begin != end) {
+                type_clause* clause = *(begin++);
+                if (cxt.unify.match_goal_rule(first, clause)) {
+                    fresh = cxt.inst.inst_rule(clause);
+                    cxt.unify.unify_goal_rule(first, fresh);
+
+
+
+                switch( dis.exp_exp(first, fresh->head)) {
+                    case disunify::same:
+                        return nullptr;
                     case disunify::different:
                         break;
                     case disunify::variable_deferred: {
@@ -1410,98 +2982,83 @@ public:
 
             return vector<type_struct*> {};
         } else {*/
-            while (begin != end) {
-                type_clause* clause = *(begin++);
-                if (cxt.unify.match_goal_rule(first, clause)) {
-                    fresh = cxt.inst.inst_rule(clause->head, clause->cyck, clause->impl, clause->id);
-                    cxt.unify.unify_goal_rule(first, fresh);
-                    vector<type_attrvar*> const& d = cxt.unify.get_deferred_goals();
-                    cout << "deferred goals: " << d.size() << endl;
-                    vector<type_struct*> impl;
-                    for (auto i : d) {
-                        for (type_attrvar* a = i; i != nullptr; i = i->next) {
-                            IF_DEBUG(
-                                cout << "THAW ";
-                                type_show ts;
-                                ts(i->goal);
-                                cout << endl;
-                            );
-                            impl.push_back(i->goal);
+            unsigned const rows = (clauses->table != nullptr) ? clauses->table->rows : 0;
+            if (index < rows && resolve_row(cxt, first, *clauses->table, next)) {
+                return true;
+            }
+            uint64_t const sig = (index != end) ? head_signature()(first) : 0;
+            while (index != end) {
+                type_clause* clause = (*clauses)[index++ - rows];
+                // clauses born after the call lie beyond end.
+                if (generation < clause->died && head_signature::compatible(sig, clause->signature)
+                    && cxt.unify.match_goal_rule(first, clause)) {
+                    next = goals->next;
+                    if (cxt.proofs) {
+                        fresh = cxt.inst.inst_rule(clause);
+                        cxt.unify.unify_goal_head(first, fresh->head);
+                        next = cxt.ast.new_goal_list(fresh->impl.cbegin(), fresh->impl.cend(), next);
+                    } else {
+                        cxt.unify.unify_goal_head(first, cxt.inst.inst_goals(clause, next));
+                    }
+                    if (thaw(cxt)) {
+                        if (cxt.profile != nullptr) {
+                            cxt.profile->tried(clause->id, pattern);
                         }
+                        return true;
                     }
-                    impl.insert(impl.end(), fresh->impl.begin(), fresh->impl.end());
-                    impl.insert(impl.end(), goal->impl.begin() + 1, goal->impl.end());
-                    return cxt.ast.new_type_clause(goal->head, goal->cyck, move(impl), clause->id);
+                    cxt.unify.backtrack(trail_checkpoint);
+                    cxt.ast.backtrack(env_checkpoint);
                 }
             }
 
             //return nullptr;
         //}
 
-        switch (builtin) {
+        // builtins have a single solution.
+        enum builtin const b = builtin;
+        builtin = not_builtin;
+        switch (b) {
             case builtin_duplicate_term: { 
-                if (cxt.unify.exp_exp(cxt.inst(first->args[0]), first->args[1])) {
-                    fresh = cxt.ast.new_type_clause(first);
-                    vector<type_attrvar*> const& d = cxt.unify.get_deferred_goals();
-                    vector<type_struct*> impl;
-                    cout << "deferred goals: " << d.size() << endl;
-                    for (auto i : d) {
-                        for (type_attrvar* a = i; i != nullptr; i = i->next) {
-                            IF_DEBUG(
-                                cout << "THAW ";
-                                type_show ts;
-                                ts(i->goal);
-                                cout << endl;
-                            );
-                            impl.push_back(i->goal);
-                        }
+                if (cxt.unify.exp_exp(cxt.inst(first->args[0]), first->args[1]) && thaw(cxt)) {
+                    if (cxt.proofs) {
+                        fresh = cxt.ast.new_type_clause(first);
                     }
-                    impl.insert(impl.end(), goal->impl.begin() + 1, goal->impl.end());
-                    return cxt.ast.new_type_clause(goal->head, goal->cyck, move(impl), 1);
+                    next = goals->next;
+                    return true;
                 }
-                return nullptr;
+                return false;
             }
             case builtin_dif: {
-                disunify dis;
-
-                switch (dis.exp_exp(first->args[0], first->args[1])) {
-                    case disunify::same:
-                        return nullptr;
-                    case disunify::variable_deferred: {
-                        type_variable* defvar = dis.get_deferred_variable();
-                        type_attrvar* v = cxt.ast.new_type_attrvar(defvar, first);
-                        defvar->replace_with(v, cxt.unify.unions);
-                        IF_DEBUG(
-                            cout << "FREEZE ";
-                            type_show ts;
-                            ts(first);
-                            cout << endl;
-                        );
-                        break;
+                type_struct* g = first;
+                if (constrain(cxt, g, nullptr) == disunify::same) {
+                    return false;
+                }
+                if (cxt.proofs) {
+                    fresh = cxt.ast.new_type_clause(first);
+                }
+                next = goals->next;
+                return true;
+            }
+            case builtin_assert:
+                if (assert_clause(cxt, first)) {
+                    if (cxt.proofs) {
+                        fresh = cxt.ast.new_type_clause(first);
                     }
-                    case disunify::attrvar_deferred: {
-                        type_attrvar* defatr = dis.get_deferred_attrvar();
-                        type_attrvar* v = cxt.ast.new_type_attrvar(defatr->var, first);
-                        v->next = defatr;
-                        defatr->replace_with(v, cxt.unify.unions);
-                        IF_DEBUG(
-                            cout << "FREEZE+ ";
-                            type_show ts;
-                            ts(first);
-                            cout << endl;
-                        );
-                        break;
+                    next = goals->next;
+                    return true;
+                }
+                return false;
+            case builtin_retract:
+                if (retract_clause(cxt, first)) {
+                    if (cxt.proofs) {
+                        fresh = cxt.ast.new_type_clause(first);
                     }
-                    case disunify::different:
-                        break;
+                    next = goals->next;
+                    return true;
                 }
-
-                fresh = cxt.ast.new_type_clause(first);
-                vector<type_struct*> impl(goal->impl.begin() + 1, goal->impl.end());
-                return cxt.ast.new_type_clause(goal->head, goal->cyck, move(impl), 1);
-            }
+                return false;
             default:
-                return nullptr;
+                return false;
         }
     }
 
@@ -1514,110 +3071,740 @@ public:
     }
 
     bool at_end() {
-        return begin == end;
+        return index == end && builtin != builtin_joined;
+    }
+
+    // the candidate position after the last success, zero for a builtin.
+    unsigned position() const {
+        return index;
+    }
+
+    // count the clause last resolved with as part of a proof, builtins
+    // and fact table rows have no clauses.
+    void credit(context &cxt) const {
+        unsigned const rows = (clauses->table != nullptr) ? clauses->table->rows : 0;
+        if (index > rows) {
+            cxt.profile->proved((*clauses)[index - 1 - rows]->id, pattern);
+        }
+    }
+
+    int heap_checkpoint() const {
+        return env_checkpoint;
+    }
+
+    int union_checkpoint() const {
+        return trail_checkpoint;
     }
 };
 
-vector<type_clause*> const unfolder::invalid {};
+predicate const unfolder::invalid {};
+
+//----------------------------------------------------------------------------
+// AND-Parallel Workers
+
+// a worker's copy of the clauses at a generation, so that its unifications
+// link only its own nodes. Dead clauses are copied too, so each clause
+// keeps its position.
+struct replica {
+    heap store;
+    env_type env;
+    unsigned const generation;
+    set<type_atom*> derived; // predicates with a rule, worth solving on a worker
+    set<type_atom*> updating; // predicates that may assert or retract
+
+    explicit replica(env_type const& from) : generation(from.generation) {
+        env.store = &store;
+        env.generation = generation;
+        env.last_id = from.last_id;
+        type_instantiate keep(store, true);
+        mark_ground ground;
+        principal functor_of;
+        for (auto const& p : from) {
+            predicate& q = env[p.first];
+            for (type_clause *const c : p.second) {
+                type_clause *const d = keep.inst_stored(c->head
+                    , vector<type_expression*>(c->impl.cbegin(), c->impl.cend()), c->id);
+                d->born = c->born;
+                d->died = c->died;
+                ground(d);
+                q.add(d, functor_of);
+                if (!c->impl.empty() && visible(c, generation)) {
+                    derived.insert(p.first);
+                }
+            }
+        }
+        for (bool grown = true; grown;) {
+            grown = false;
+            for (auto const& p : env) {
+                for (auto c = p.second.cbegin(); updating.count(p.first) == 0 && c != p.second.cend(); ++c) {
+                    for (type_struct *const g : (*c)->impl) {
+                        if (updates(g->functor)) {
+                            updating.insert(p.first);
+                            grown = true;
+                            break;
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    bool updates(type_atom *const functor) const {
+        return updating.count(functor) != 0 || functor->value == "assert" || functor->value == "retract";
+    }
+};
+
+// a thread that solves one job at a time, depth first as the solver does,
+// publishing each solution with the least room it needs.
+class and_worker {
+    atoms &names;
+    unique_ptr<replica> db;
+    mutex lock;
+    condition_variable wake;
+    and_job *job;
+    bool quit;
+    thread runner;
+
+    void publish(and_job &j, vector<unfolder> const& stack, vector<int> const& peaks) {
+        and_job::solution s;
+        for (unfolder const& u : stack) {
+            s.path.push_back(u.position());
+        }
+        s.need = *max_element(peaks.cbegin(), peaks.cend());
+        j.publish(move(s));
+    }
+
+    // the cost of a step is checked as the solver checks it, and the
+    // largest checked cost of each frame's steps is kept: when the solver
+    // has less room, a step beyond it would have dropped the frame.
+    void solve(and_job &j) {
+        context cxt(names, db->env, nullptr, false);
+        int const trail_checkpoint = cxt.unify.checkpoint();
+        int const env_checkpoint = cxt.ast.checkpoint();
+        vector<unfolder> stack;
+        vector<int> peaks;
+        stack.emplace_back(cxt, cxt.ast.new_goal_list(j.goal, nullptr));
+        peaks.push_back(0);
+        while (!stack.empty() && !j.cancel) {
+            goal_list *next;
+            bool pop = !stack.back().get(cxt, next);
+            if (!pop && (next != nullptr || j.rest != 0)) {
+                int const cost = static_cast<int>(stack.size()) + ((next == nullptr) ? 0 : next->size);
+                pop = cost > j.limit;
+                if (!pop && cost > peaks.back()) {
+                    peaks.back() = cost;
+                }
+            }
+            if (pop) {
+                do {
+                    stack.pop_back();
+                    peaks.pop_back();
+                } while (!stack.empty() && stack.back().at_end());
+            } else if (next == nullptr) {
+                publish(j, stack, peaks);
+            } else {
+                stack.emplace_back(cxt, next);
+                peaks.push_back(0);
+            }
+        }
+        stack.clear();
+        cxt.unify.backtrack(trail_checkpoint);
+        cxt.ast.backtrack(env_checkpoint);
+    }
+
+    void run() {
+        unique_lock<mutex> l(lock);
+        for (;;) {
+            wake.wait(l, [this]() {return job != nullptr || quit;});
+            if (quit) {
+                return;
+            }
+            and_job &j = *job;
+            l.unlock();
+            solve(j);
+            j.finish();
+            l.lock();
+            job = nullptr;
+        }
+    }
+
+public:
+    explicit and_worker(atoms &names) : names(names), job(nullptr), quit(false), runner(&and_worker::run, this) {}
+    and_worker(and_worker const&) = delete;
+    and_worker& operator= (and_worker const&) = delete;
+
+    ~and_worker() {
+        {
+            lock_guard<mutex> const l(lock);
+            quit = true;
+        }
+        wake.notify_all();
+        runner.join();
+    }
+
+    bool idle() {
+        lock_guard<mutex> const l(lock);
+        return job == nullptr;
+    }
+
+    // the clauses of env as of its generation, copied again when they have
+    // changed; only while idle.
+    replica const& database(env_type const& env) {
+        if (db == nullptr || db->generation != env.generation) {
+            db.reset(new replica(env));
+        }
+        return *db;
+    }
+
+    void start(and_job *const j) {
+        {
+            lock_guard<mutex> const l(lock);
+            job = j;
+        }
+        wake.notify_all();
+    }
+};
+
+class and_pool {
+    vector<unique_ptr<and_worker>> workers;
+
+public:
+    and_pool(atoms &names, unsigned const n) {
+        for (unsigned i = 0; i < n; ++i) {
+            workers.emplace_back(new and_worker(names));
+        }
+    }
+
+    and_worker* idle() {
+        for (auto const& w : workers) {
+            if (w->idle()) {
+                return w.get();
+            }
+        }
+        return nullptr;
+    }
+};
+
+//----------------------------------------------------------------------------
+// Answer: the substitution for the query variables, copied out of the
+// solver's heap so it stays valid while the solver backtracks for the next
+// answer. The copies are released when the next answer is assigned.
+
+class answer {
+    heap terms;
+    type_instantiate inst;
+
+public:
+    vector<pair<type_variable*, type_expression*>> bindings;
+
+    answer(const answer&) = delete;
+    answer& operator= (const answer&) = delete;
+
+    answer() : inst(terms) {}
+
+    void clear() {
+        bindings.clear();
+        terms.backtrack(0);
+    }
+
+    // the query clause head has the query variables as its arguments.
+    void assign(type_struct *const head) {
+        clear();
+        vector<type_expression*> const values = inst(vector<type_expression*>(head->args.cbegin(), head->args.cend()));
+        for (size_t i = 0; i < values.size(); ++i) {
+            bindings.emplace_back(static_cast<type_variable*>(head->args[i]), values[i]);
+        }
+    }
+};
 
 //----------------------------------------------------------------------------
 // Transitive Closure
 
 class solver {
+    // a partial resolvent on the best first frontier, copied out of the
+    // context into its own heap. The path holds the alternative taken at
+    // each step, so the proof can be replayed depth first.
+    struct resolvent {
+        uint64_t cost;
+        uint64_t seq;
+        heap terms;
+        type_struct *head;
+        vector<type_struct*> goals;
+        vector<int> path;
+    };
+
     static int next_id;
     int const id;
 
     context cxt;
     int const trail_checkpoint;
     int const env_checkpoint;
-    vector<unique_ptr<unfolder>> or_stack;
+    vector<unfolder> or_stack;
+    size_t peak_frames;
+    type_clause *const query;
+    type_struct *const head;
     int const max_depth;
-    int depth;
+    options const opts;
+    bool const forking; // hand independent goals to workers, unless on one core or a budget would count differently
+    statistics stats;
+    chrono::steady_clock::time_point const start;
+    vector<unique_ptr<resolvent>> frontier;
+    unique_ptr<resolvent> solved; // holds the answer when there is no proof to replay
+    size_t frontier_nodes;
+    size_t frontier_bytes; // measured only with the memory option
+    size_t peak_frontier;
+    uint64_t seq;
+    map<type_atom*, unsigned> weights;
+
+public:
+    enum resource {none, inferences, time, heap_nodes, trail_entries} exceeded;
+
+private:
+    uint64_t elapsed() const {
+        return chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+    }
+
+    // the bytes a resolvent on the frontier holds.
+    static size_t footprint(resolvent const& r) {
+        return sizeof(resolvent) + r.terms.term_bytes() + r.terms.constraint_bytes()
+            + r.goals.capacity() * sizeof(type_struct*) + r.path.capacity() * sizeof(int);
+    }
+
+    // sample the bytes held, at each inference when measuring.
+    void measure() {
+        memory_use& m = stats.peak_memory;
+        size_t const trail = cxt.unify.bytes() + cxt.dif.bytes();
+        size_t const frames = or_stack.capacity() * sizeof(unfolder);
+        m.terms = max(m.terms, cxt.ast.peak_term_bytes());
+        m.constraints = max(m.constraints, cxt.ast.peak_constraint_bytes());
+        m.trail = max(m.trail, trail);
+        m.choice_points = max(m.choice_points, frames);
+        m.frontier = max(m.frontier, frontier_bytes);
+        m.total = max(m.total, cxt.ast.term_bytes() + cxt.ast.constraint_bytes() + trail + frames + frontier_bytes);
+    }
+
+    // count an inference if the budget allows one more, checking the
+    // other limits; the clock is only read every 256 inferences.
+    bool within_budget() {
+        if (opts.limits.inferences != 0 && stats.inferences >= opts.limits.inferences) {
+            exceeded = inferences;
+            return false;
+        }
+        ++stats.inferences;
+        if (opts.memory) {
+            measure();
+        }
+        size_t const nodes = cxt.ast.checkpoint() + frontier_nodes;
+        size_t const entries = cxt.unify.checkpoint();
+        if (nodes > stats.peak_heap_nodes) {
+            stats.peak_heap_nodes = nodes;
+        }
+        if (entries > stats.peak_trail_entries) {
+            stats.peak_trail_entries = entries;
+        }
+        if (opts.limits.heap_nodes != 0 && nodes > opts.limits.heap_nodes) {
+            exceeded = heap_nodes;
+        } else if (opts.limits.trail_entries != 0 && entries > opts.limits.trail_entries) {
+            exceeded = trail_entries;
+        } else if (opts.limits.time != 0 && (stats.inferences & 0xff) == 0 && elapsed() > opts.limits.time) {
+            exceeded = time;
+        }
+        return exceeded == none;
+    }
+
+    // the number of clauses whose heads have the same principal functors as
+    // the arguments of g, counting stops at limit. Every row of a fact table
+    // is counted.
+    int candidates(type_struct *const g, int const limit) {
+        env_type::const_iterator const i = cxt.env.find(g->functor);
+        if (i == cxt.env.end()) {
+            return (g->functor->value == "dif" && g->args.size() == 2) ? 1 : 0;
+        }
+        vector<pair<type_atom*, int>> keys;
+        for (type_expression *const e : g->args) {
+            keys.push_back(cxt.functor_of(e));
+        }
+        int n = (i->second.table == nullptr) ? 0
+            : static_cast<int>(min<size_t>(i->second.table->rows, limit));
+        for (type_clause *const c : i->second) {
+            if (n >= limit) {
+                break;
+            }
+            bool matches = c->head->args.size() == keys.size();
+            for (size_t j = 0; matches && j < keys.size(); ++j) {
+                if (keys[j].first != nullptr) {
+                    pair<type_atom*, int> const k = cxt.functor_of(c->head->args[j]);
+                    matches = (k.first == nullptr) || (k == keys[j]);
+                }
+            }
+            if (matches) {
+                ++n;
+            }
+        }
+        return n;
+    }
+
+    // fail first: move the goal with the fewest candidate clauses to the
+    // front, the leftmost on ties. Goals after a duplicate_term are not
+    // considered, as copying a term depends on the bindings made before it,
+    // nor after an assert or retract, which depend on bindings and order.
+    goal_list* select(goal_list *const goals) {
+        goal_list *best = goals;
+        int fewest = numeric_limits<int>::max();
+        for (goal_list *g = goals; g != nullptr && fewest > 0; g = g->next) {
+            string const& name = g->goal->functor->value;
+            if (name == "duplicate_term" || name == "assert" || name == "retract") {
+                break;
+            }
+            int const n = candidates(g->goal, fewest);
+            if (n < fewest) {
+                fewest = n;
+                best = g;
+            }
+        }
+        if (best == goals) {
+            return goals;
+        }
+        vector<type_struct*> prefix;
+        for (goal_list *g = goals; g != best; g = g->next) {
+            prefix.push_back(g->goal);
+        }
+        return cxt.ast.new_goal_list(best->goal
+            , cxt.ast.new_goal_list(prefix.cbegin(), prefix.cend(), best->next));
+    }
+
+    void push(goal_list *goals) {
+        if (opts.fail_first) {
+            goals = select(goals);
+        }
+        or_stack.emplace_back(cxt, goals);
+        if (or_stack.size() > peak_frames) {
+            peak_frames = or_stack.size();
+        }
+        if (forking) {
+            fork(goals);
+        }
+    }
+
+    // hand the second goal of a new resolvent to an idle worker when it is
+    // independent of the first and can neither update the clauses nor be
+    // followed by a goal that does. Fact tables are not copied to workers.
+    void fork(goal_list *const goals) {
+        goal_list *const second = goals->next;
+        if (second == nullptr || !cxt.script.empty() || !cxt.env.tables.empty() || cxt.joined(second) != nullptr) {
+            return;
+        }
+        int const rest = (second->next == nullptr) ? 0 : second->next->size;
+        int const limit = max_depth - static_cast<int>(or_stack.size()) - rest;
+        and_worker *const w = (limit > 0) ? cxt.env.workers->idle() : nullptr;
+        if (w == nullptr) {
+            return;
+        }
+        replica const& db = w->database(cxt.env);
+        if (db.derived.count(second->goal->functor) == 0) {
+            return;
+        }
+        for (goal_list *g = second; g != nullptr; g = g->next) {
+            if (db.updates(g->goal->functor)) {
+                return;
+            }
+        }
+        if (!independent(goals->goal, second->goal)) {
+            return;
+        }
+        unique_ptr<and_job> j(new and_job(second, limit, cxt.env.generation, or_stack.size()));
+        j->goal = type_instantiate(j->terms, true).inst_goal(second->goal);
+        w->start(j.get());
+        cxt.jobs.push_back(move(j));
+    }
+
+    // cancel the jobs forked by frames that have been popped, and any
+    // replay they were part of.
+    void unfork() {
+        while (!cxt.jobs.empty() && cxt.jobs.back()->height > or_stack.size()) {
+            cxt.jobs.pop_back();
+        }
+        cxt.script.clear();
+    }
+
+    void reset() {
+        or_stack.clear();
+        unfork();
+        cxt.unify.backtrack(trail_checkpoint);
+        cxt.ast.backtrack(env_checkpoint);
+    }
+
+    type_clause* solution() {
+        if (cxt.profile != nullptr) {
+            for (unfolder const& u : or_stack) {
+                u.credit(cxt);
+            }
+        }
+        next_goal = cxt.ast.new_type_clause(head);
+        stats.time = elapsed();
+        return next_goal;
+    }
+
+    unsigned weight(type_atom *const functor) const {
+        auto const i = weights.find(functor);
+        return (i == weights.cend()) ? 1 : i->second;
+    }
+
+    // lower cost first, then deeper, then older.
+    static bool costlier(unique_ptr<resolvent> const& a, unique_ptr<resolvent> const& b) {
+        if (a->cost != b->cost) {
+            return a->cost > b->cost;
+        } else if (a->path.size() != b->path.size()) {
+            return a->path.size() < b->path.size();
+        }
+        return a->seq > b->seq;
+    }
+
+    // the cost of a resolvent is its depth plus the weights of its goals,
+    // with unit weights this is a lower bound on the depth of its proofs.
+    void enqueue(unique_ptr<resolvent> r) {
+        r->cost = r->path.size();
+        for (type_struct *const g : r->goals) {
+            r->cost += weight(g->functor);
+        }
+        r->seq = seq++;
+        frontier_nodes += r->terms.checkpoint();
+        if (opts.memory) {
+            frontier_bytes += footprint(*r);
+        }
+        frontier.push_back(move(r));
+        push_heap(frontier.begin(), frontier.end(), &solver::costlier);
+        if (frontier.size() > peak_frontier) {
+            peak_frontier = frontier.size();
+        }
+    }
+
+    // copy the resolvent reached by taking alternative k from r out of the
+    // context, sharing variables between the answer and the goals.
+    void branch(resolvent &r, int const k, goal_list *const next) {
+        unique_ptr<resolvent> c(new resolvent);
+        if (opts.memory) {
+            c->terms.measure();
+        }
+        vector<type_expression*> ts {r.head};
+        for (goal_list *g = next; g != nullptr; g = g->next) {
+            ts.push_back(g->goal);
+        }
+        type_instantiate inst(c->terms);
+        vector<type_expression*> const es = inst(ts);
+        c->head = static_cast<type_struct*>(es[0]);
+        for (auto i = es.cbegin() + 1; i != es.cend(); ++i) {
+            c->goals.push_back(static_cast<type_struct*>(*i));
+        }
+        c->path = r.path;
+        c->path.push_back(k);
+        enqueue(move(c));
+    }
+
+    // rebuild the or-stack of a proof from its path, leaving its bindings
+    // in the context.
+    type_clause* replay(vector<int> const& path) {
+        push(cxt.ast.new_goal_list(query->impl.cbegin(), query->impl.cend(), nullptr));
+        goal_list *next = nullptr;
+        for (int const k : path) {
+            for (int j = 0; j <= k; ++j) {
+                or_stack.back().get(cxt, next);
+            }
+            if (next != nullptr) {
+                push(next);
+            }
+        }
+        return solution();
+    }
+
+    // expand the cheapest resolvent on the frontier, enqueuing all its
+    // children. A resolvent with no goals left is a proof.
+    type_clause* best_first() {
+        while (!frontier.empty()) {
+            pop_heap(frontier.begin(), frontier.end(), &solver::costlier);
+            unique_ptr<resolvent> r = move(frontier.back());
+            frontier.pop_back();
+            frontier_nodes -= r->terms.checkpoint();
+            if (opts.memory) {
+                frontier_bytes -= footprint(*r);
+            }
+            reset();
+            if (r->goals.empty()) {
+                if (cxt.proofs || cxt.profile != nullptr) {
+                    return replay(r->path);
+                }
+                solved = move(r);
+                cxt.unify.exp_exp(head, solved->head);
+                return solution();
+            }
+            push(cxt.ast.new_goal_list(r->goals.cbegin(), r->goals.cend(), nullptr));
+            goal_list *next;
+            for (int k = 0; within_budget() && or_stack.back().get(cxt, next); ++k) {
+                if (next == nullptr || static_cast<int>(r->path.size()) + 1 + next->size <= max_depth) {
+                    branch(*r, k, next);
+                }
+            }
+            if (exceeded != none) {
+                stop();
+            }
+        }
+        IF_DEBUG(cout << "FINISH\n";)
+        stats.time = elapsed();
+        reset();
+        return nullptr;
+    }
 
 public:
     solver(const solver&) = delete;
-    solver(solver&&) = default;
+    solver(solver&&) = delete;
     solver& operator= (const solver&) = delete;
 
-    solver(atoms &names, env_type &env, type_clause *goal, int d) 
+    solver(atoms &names, env_type &env, type_clause *goal, int d, options const& o = options {}
+    , clause_profile *const profile = nullptr) 
     : id(++next_id)
-    , cxt(names, env)
+    , cxt(names, env, profile, !o.answers_only)
     , trail_checkpoint(cxt.unify.checkpoint())
     , env_checkpoint(cxt.ast.checkpoint())
+    , peak_frames(0)
+    , query(goal)
+    , head(goal->head)
     , max_depth(d)
+    , opts(o)
+    , forking(o.parallel > 0 && thread::hardware_concurrency() > 1
+        && !o.best_first && !o.fail_first && profile == nullptr
+        && o.limits.inferences == 0 && o.limits.heap_nodes == 0 && o.limits.trail_entries == 0)
+    , start(chrono::steady_clock::now())
+    , frontier_nodes(0)
+    , frontier_bytes(0)
+    , peak_frontier(0)
+    , seq(0)
+    , exceeded(none)
     {
         //depth_profile p(max_depth);
-        or_stack.emplace_back(new unfolder(cxt, goal, 0));
+        ++cxt.env.running;
+        if (opts.memory) {
+            cxt.ast.measure();
+        }
+        if (opts.best_first) {
+            for (auto const& w : opts.weights) {
+                atoms::const_iterator const i = names.find(w.first);
+                if (i != names.cend()) {
+                    weights.emplace(i->second, w.second);
+                }
+            }
+            unique_ptr<resolvent> r(new resolvent);
+            r->head = head;
+            r->goals = goal->impl;
+            enqueue(move(r));
+        } else {
+            if (forking && cxt.env.workers == nullptr) {
+                cxt.env.workers.reset(new and_pool(names, min(opts.parallel, thread::hardware_concurrency())));
+            }
+            push(cxt.ast.new_goal_list(goal->impl.cbegin(), goal->impl.cend(), nullptr));
+        }
         //cout << "SOLVER " << id << " CONS\n";
     }
 
     ~solver() {
         //cout << "SOLVER " << id << " DEST\n";
         stop();
+        if (--cxt.env.running == 0) {
+            collect(cxt.env);
+        }
     }
 
     type_clause *next_goal;
 
+    // returns the next proof, or nullptr when there are none left. After a
+    // proof is returned, calling get again backtracks into it, so the
+    // solver streams every answer within the depth bound. When the budget
+    // is exceeded the search is stopped and nullptr returned.
     type_clause* get() {
         depth_profile p(max_depth);
+        if (opts.best_first) {
+            return best_first();
+        }
         //cout << "SOLVER GET\n";
         while (!or_stack.empty()) {
-            unfolder &src = *(or_stack.back());
-            next_goal = src.get();
+            if (!within_budget()) {
+                stop();
+                break;
+            }
+            unfolder &src = or_stack.back();
+            goal_list *next;
             //cout << "SOLVER GOT\n";
-            if (next_goal != nullptr) {
+            cxt.room = max_depth - static_cast<int>(or_stack.size());
+            if (src.get(cxt, next)) {
                 //cout << "[" << or_stack.size() << "] ";
                 //(type_show {}) (src.goal);
                 //cout << "\n";
                 //cout << "SUCC\n";
-                if (next_goal->impl.empty()) {
-                    return next_goal;
+                if (next == nullptr) {
+                    return solution();
                 }
                 //if (src.at_end()) { // LCO
                 //    or_stack.pop_back();
                 //    cout << "[" << or_stack.size() << "] LCO\n";
                 //}
-                //cout << or_stack.size() << " " << next_goal->impl.size() << " <= " << max_depth << endl;
-                if (or_stack.size() + next_goal->impl.size() <= max_depth) {
+                //cout << or_stack.size() << " " << next->size << " <= " << max_depth << endl;
+                if (or_stack.size() + next->size <= max_depth) {
                     //cout << "PUSH" << endl;
-                    or_stack.emplace_back(new unfolder(cxt, next_goal, depth));
+                    push(next);
                 } else {
-                    cout << "EXCEED\n";
+                    IF_DEBUG(cout << "EXCEED\n";)
                     or_stack.pop_back(); 
-                    cout << "[" << or_stack.size() << "]\n";
-                    while (!or_stack.empty() && or_stack.back()->at_end()) {
+                    IF_DEBUG(cout << "[" << or_stack.size() << "]\n";)
+                    while (!or_stack.empty() && or_stack.back().at_end()) {
                         or_stack.pop_back();
                     }
+                    unfork();
                 }
             } else {
-                cout << "FAIL\n";
+                IF_DEBUG(cout << "FAIL\n";)
                 or_stack.pop_back(); 
-                cout << "[" << or_stack.size() << "]\n";
-                while (!or_stack.empty() && or_stack.back()->at_end()) {
+                IF_DEBUG(cout << "[" << or_stack.size() << "]\n";)
+                while (!or_stack.empty() && or_stack.back().at_end()) {
                     or_stack.pop_back();
                 }
+                unfork();
             }
         }
-        cout << "FINISH\n";
+        IF_DEBUG(cout << "FINISH\n";)
+        stats.time = elapsed();
         or_stack.clear();
+        unfork();
         cxt.unify.backtrack(trail_checkpoint);
         cxt.ast.backtrack(env_checkpoint);
         return nullptr;
         /*
         next_goal = cxt.ast.new_type_clause(
             cxt.ast.new_type_struct(cxt.names.find("np")->second, vector<type_expression*> {}),
-            set<type_variable*> {},
+            vector<type_variable*> {},
             vector<type_struct*> {}
         );
         return next_goal;
         */
     }
 
+    // fetch the next answer, materialised into a.
+    bool next(answer& a) {
+        type_clause *const t = get();
+        if (t == nullptr) {
+            a.clear();
+            return false;
+        }
+        a.assign(t->head);
+        return true;
+    }
+
     ostream& show_proof(ostream& out) {
+        if (!cxt.proofs) {
+            return out;
+        }
         out << "PROOF:" << endl;
         type_show ts;
         for (auto i = or_stack.begin(); i != or_stack.end(); ++i) {
-            type_clause *t = (*i)->reget();
+            type_clause *t = i->reget();
             //if (t->impl.size() > 0) {
                 //out << "<" << (*i)->depth << ">";
                 //ts(t->head);
@@ -1629,11 +3816,76 @@ public:
         return out;
     }
 
+    statistics const& get_statistics() const {
+        return stats;
+    }
+
+    char const* exceeded_name() const {
+        static char const *const names[] = {"none", "inferences", "time", "heap nodes", "trail entries"};
+        return names[exceeded];
+    }
+
+    // the clauses of the current proof, in order, none without proofs.
+    vector<type_clause*> proof() {
+        vector<type_clause*> cs;
+        for (unfolder& u : or_stack) {
+            if (!cxt.proofs) {
+                break;
+            }
+            cs.push_back(u.reget());
+        }
+        return cs;
+    }
+
+    ostream& show_statistics(ostream& out) {
+        if (exceeded != none) {
+            out << "RESOURCE EXCEEDED: " << exceeded_name() << endl;
+        }
+        out << "INFERENCES: " << stats.inferences
+            << " PEAK HEAP NODES: " << stats.peak_heap_nodes
+            << " PEAK TRAIL ENTRIES: " << stats.peak_trail_entries
+            << " WALL TIME: " << stats.time << "us" << endl;
+        return out;
+    }
+
+    ostream& show_memory(ostream& out) {
+        memory_use const& m = stats.peak_memory;
+        out << "PEAK BYTES: TERMS: " << m.terms
+            << " CONSTRAINTS: " << m.constraints
+            << " TRAIL: " << m.trail
+            << " CHOICE POINTS: " << m.choice_points
+            << " FRONTIER: " << m.frontier
+            << " TOTAL: " << m.total << endl;
+        return out;
+    }
+
+    // choice point frames are fixed size, the heap nodes and trail entries
+    // each level of the search owns are shown per level in debug builds.
+    ostream& show_stack(ostream& out) {
+        out << "CHOICE POINTS: " << peak_frames << " peak frames of "
+            << sizeof(unfolder) << " bytes, "
+            << or_stack.capacity() * sizeof(unfolder) << " bytes reserved" << endl;
+        if (opts.best_first) {
+            out << "FRONTIER: " << peak_frontier << " peak resolvents, "
+                << frontier.size() << " open" << endl;
+        }
+        IF_DEBUG(
+            for (auto i = or_stack.cbegin(); i != or_stack.cend(); ++i) {
+                int const heap_end = (i + 1 != or_stack.cend()) ? (i + 1)->heap_checkpoint() : cxt.ast.checkpoint();
+                int const trail_end = (i + 1 != or_stack.cend()) ? (i + 1)->union_checkpoint() : cxt.unify.checkpoint();
+                out << "[" << (i - or_stack.cbegin()) << "] heap nodes: " << (heap_end - i->heap_checkpoint())
+                    << " trail entries: " << (trail_end - i->union_checkpoint()) << endl;
+            }
+        )
+        return out;
+    }
+
     virtual void stop() {
         //cout << "SOLVER " << id << " STOP\n";
-        or_stack.clear();
-        cxt.unify.backtrack(trail_checkpoint);
-        cxt.ast.backtrack(env_checkpoint);
+        frontier.clear();
+        frontier_nodes = 0;
+        frontier_bytes = 0;
+        reset();
     }
 
     type_clause* reget() {
@@ -1641,7 +3893,7 @@ public:
     }
 
     virtual bool at_end() {
-        return or_stack.empty();
+        return or_stack.empty() && frontier.empty();
     }
 };
 
@@ -1667,12 +3919,59 @@ is_not<is_either<is_char, is_char>> not_nl_or_eof(is_nl_or_eof);
 
 // Logic Parser --------------------------------------------------------------
 
+// the atoms of a program, shared by the parsers of files loaded in
+// parallel. The program's atoms are only read while the files are parsed,
+// new atoms are made in shards each with its own lock, and are added to
+// the program's atoms once parsing is done.
+class atom_table {
+    static size_t const shards = 64;
+
+    struct shard {
+        mutex lock;
+        unordered_map<string, type_atom*> made;
+    };
+
+    atoms& names;
+    shard made[shards];
+
+public:
+    explicit atom_table(atoms& names) : names(names) {}
+
+    type_atom* intern(heap& h, string const& a) {
+        auto const i = names.find(a);
+        if (i != names.end()) {
+            return i->second;
+        }
+        shard& s = made[std::hash<string>()(a) % shards];
+        lock_guard<mutex> const g(s.lock);
+        type_atom*& t = s.made[a];
+        if (t == nullptr) {
+            t = h.new_type_atom(a);
+        }
+        return t;
+    }
+
+    void publish() {
+        for (shard& s : made) {
+            names.insert(s.made.cbegin(), s.made.cend());
+            s.made.clear();
+        }
+    }
+};
+
 class term_parser : public fparse {
+    options const& opts;
     type_show show_type;
     heap& ast;
+    heap *terms; // where parsed terms are made, ast unless parsing a query
+    atom_table *const shared; // nullptr unless parsing one of several files
+    vector<type_clause*> loaded; // with a shared table, the clauses for merge to add
     set<type_variable*> repeated;
     map<string, type_variable*> vmap;
-    int clause_id;
+    string json;
+    env_type env;
+    vector<vector<type_struct*>> goals;
+    mark_ground ground;
 
     atoms names = {
         make_pair("np", ast.new_type_atom("np")),
@@ -1687,7 +3986,7 @@ public:
         space();
         map<string, type_variable*>::iterator i = vmap.find(n);
         if (i == vmap.end()) {
-            type_variable *v = ast.new_type_variable(n);
+            type_variable *v = terms->new_type_variable(n, vmap.size());
             vmap.insert(make_pair(n, v));
             return v;
         } else {
@@ -1696,19 +3995,16 @@ public:
         }
     }
 
+    type_atom* intern(string const& a) {
+        return (shared == nullptr) ? detail::intern(names, ast, a) : shared->intern(ast, a);
+    }
+
     type_atom* atom() {
         string a;
         expect(is_lower, &a);
         while (accept(is_name1, &a));
         space();
-        auto const i = names.find(a);
-        if (i == names.end()) {
-            type_atom *t = ast.new_type_atom(a);
-            names.insert(make_pair(a, t));
-            return t;
-        } else {
-            return i->second;
-        }
+        return intern(a);
     }
 
     type_expression* term() {
@@ -1720,7 +4016,7 @@ public:
             if (accept(is_brace_open)) {
                 vector<type_expression*> terms = parse_terms();
                 expect(is_brace_close);
-                return ast.new_type_struct(a, move(terms), negated);
+                return this->terms->new_type_struct(a, move(terms), negated);
             } else {
                 return a;
             }
@@ -1747,10 +4043,10 @@ public:
             vector<type_expression*> terms {parse_terms()};
             expect(is_brace_close);
             space();
-            return ast.new_type_struct(functor, move(terms), negated);
+            return this->terms->new_type_struct(functor, move(terms), negated);
         } else {
             space();
-            return ast.new_type_struct(functor, vector<type_expression*> {}, negated);
+            return terms->new_type_struct(functor, vector<type_expression*> {}, negated);
         } 
     }
 
@@ -1766,91 +4062,464 @@ public:
 
     type_clause* parse_rule() {
         type_struct *head = nullptr;
-        set<type_variable*> cyck {};
+        vector<type_variable*> cyck {};
         vector<type_struct*> impl {};
 
         repeated.clear();
         if (!test(is_colon)) {
             head = parse_struct();
-            cyck = repeated;
+            cyck.assign(repeated.cbegin(), repeated.cend());
         }
         if (accept(is_colon)) {
             expect(is_minus);
             impl = parse_structs();
         } 
         expect(is_dot);
-        return ast.new_type_clause(head, move(cyck), move(impl), ++clause_id);
+        return ast.new_type_clause(head, move(cyck), move(impl), ++env.last_id, vmap.size());
+    }
+
+    // stream every answer of the solver, starting from its first proof.
+    // The proof clause is released when the solver backtracks, the query
+    // head it refers to is not.
+    void show_answers(solver& solve, type_clause *const first) {
+        type_struct *const head = first->head;
+        answer ans;
+        ans.assign(head);
+        int n = 0;
+        do {
+            ++n;
+            if (!opts.answers_only) {
+                solve.show_proof(cout);
+                cout << endl;
+            }
+            cout << head->functor->value;
+            if (!ans.bindings.empty()) {
+                cout << "(";
+                show_type.bindings(ans.bindings);
+                cout << ")";
+            }
+            cout << "." << endl << endl;
+        } while (solve.next(ans));
+        cout << n << " ANSWERS" << endl << endl;
+    }
+
+    // the peak bytes of each deepening iteration, with the memory option.
+    void show_memory(solver& solve) {
+        if (opts.memory) {
+            solve.show_memory(cout);
+            cout << endl;
+        }
+    }
+
+    void json_escape(string const& s) {
+        for (char const c : s) {
+            switch (c) {
+                case '"': json += "\\\""; break;
+                case '\\': json += "\\\\"; break;
+                case '\n': json += "\\n"; break;
+                case '\t': json += "\\t"; break;
+                default:
+                    if (static_cast<unsigned char>(c) < 0x20) {
+                        static char const hex[] = "0123456789abcdef";
+                        json += "\\u00";
+                        json += hex[c >> 4];
+                        json += hex[c & 0xf];
+                    } else {
+                        json += c;
+                    }
+                    break;
+            }
+        }
+    }
+
+    void json_string(string const& s) {
+        json += '"';
+        json_escape(s);
+        json += '"';
+    }
+
+    void json_answer(solver& solve, answer const& ans) {
+        json += "{\"bindings\": {";
+        for (auto i = ans.bindings.cbegin(); i != ans.bindings.cend(); ++i) {
+            json_string(show_type.name(i->first));
+            json += ": ";
+            json_string(show_type.value(i->second));
+            if (i + 1 != ans.bindings.cend()) {
+                json += ", ";
+            }
+        }
+        json += '}';
+        if (opts.answers_only) {
+            json += '}';
+            return;
+        }
+        json += ", \"proof\": [";
+        vector<type_clause*> const steps = solve.proof();
+        for (auto i = steps.cbegin(); i != steps.cend(); ++i) {
+            json += "{\"clause\": " + to_string((*i)->id) + ", \"head\": ";
+            json_string(show_type.str((*i)->head));
+            json += ", \"body\": [";
+            for (auto j = (*i)->impl.cbegin(); j != (*i)->impl.cend(); ++j) {
+                json_string(show_type.str(*j));
+                if (j + 1 != (*i)->impl.cend()) {
+                    json += ", ";
+                }
+            }
+            json += "]}";
+            if (i + 1 != steps.cend()) {
+                json += ", ";
+            }
+        }
+        json += "]}";
+    }
+
+    // one line of JSON per query, with its answers, each with its proof,
+    // and the solver statistics. The query is shown before it is solved.
+    void json_query(vector<type_struct*> const& goal) {
+        json.clear();
+        json += "{\"query\": \"";
+        for (auto g = goal.cbegin(); g != goal.cend(); ++g) {
+            json_escape(show_type.str(*g));
+            if (g + 1 != goal.cend()) {
+                json += ", ";
+            }
+        }
+        json += "\", ";
+    }
+
+    void show_json(solver& solve, type_clause *const first) {
+        json += "\"answers\": [";
+        if (first != nullptr) {
+            answer ans;
+            ans.assign(first->head);
+            do {
+                json_answer(solve, ans);
+                if (!opts.all_solutions) {
+                    break;
+                }
+                json += ", ";
+            } while (solve.next(ans));
+            if (json.compare(json.size() - 2, 2, ", ") == 0) {
+                json.resize(json.size() - 2);
+            }
+        }
+        statistics const& stats = solve.get_statistics();
+        json += "], \"exceeded\": ";
+        json_string(solve.exceeded_name());
+        json += ", \"statistics\": {\"inferences\": " + to_string(stats.inferences)
+            + ", \"time_us\": " + to_string(stats.time)
+            + ", \"peak_heap_nodes\": " + to_string(stats.peak_heap_nodes)
+            + ", \"peak_trail_entries\": " + to_string(stats.peak_trail_entries);
+        if (opts.memory) {
+            memory_use const& m = stats.peak_memory;
+            json += ", \"peak_bytes\": {\"terms\": " + to_string(m.terms)
+                + ", \"constraints\": " + to_string(m.constraints)
+                + ", \"trail\": " + to_string(m.trail)
+                + ", \"choice_points\": " + to_string(m.choice_points)
+                + ", \"frontier\": " + to_string(m.frontier)
+                + ", \"total\": " + to_string(m.total) + "}";
+        }
+        json += "}}\n";
+        cout.write(json.data(), json.size());
+    }
+
+    term_parser(heap &ast, options const& opts) : opts(opts), ast(ast), terms(&ast), shared(nullptr) {
+        env.store = &ast;
     }
 
-    explicit term_parser(heap &ast) : ast(ast), clause_id(0) {}
+    // a parser for one of several files, its atoms interned in shared.
+    term_parser(heap &ast, options const& opts, atom_table& shared)
+        : opts(opts), ast(ast), terms(&ast), shared(&shared), names() {
+        env.store = &ast;
+    }
 
-    void operator() (fstream *f) {
-        env_type env;
-        vector<vector<type_struct*>> goals;
+    // add the clauses and queries of another parser after those of this
+    // one, numbering its clauses as if its file had been loaded here.
+    void merge(term_parser& file) {
+        int const offset = env.last_id;
+        for (type_clause *const c : file.loaded) {
+            c->id += offset;
+            add_clause(env, c);
+        }
+        env.last_id += file.env.last_id;
+        goals.insert(goals.end(), file.goals.cbegin(), file.goals.cend());
+    }
 
-        set_fstream(f);
+    // add the clauses and queries of a program.
+    void load(istream *f) {
+        set_stream(f);
         do {
             space();
             if (accept(is_hash)) {
                 while(accept(not_nl_or_eof));
             } else {
                 type_clause *r = parse_rule();
+                ground(r);
                 if (r->head == nullptr) {
                     goals.push_back(r->impl);
+                } else if (shared != nullptr) {
+                    loaded.push_back(r);
                 } else {
-                    env_type::iterator const i = env.find(r->head->functor);
-                    if (i == env.end()) {
-                        env.emplace(r->head->functor, vector<type_clause*> {r});
-                    } else {
-                        i->second.push_back(r);
-                    }
+                    add_clause(env, r);
                 }
             }
             space();
             vmap.clear();
         } while (!accept(is_eof));
+    }
+
+    // whether the text of s from b to e is an atom as atom() reads one.
+    static bool is_atom(string const& s, size_t const b, size_t const e) {
+        if (b == e || !is_lower(static_cast<unsigned char>(s[b]))) {
+            return false;
+        }
+        for (size_t i = b + 1; i < e; ++i) {
+            if (!is_name1(static_cast<unsigned char>(s[i]))) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // ground facts for a predicate, one per line of fields separated by
+    // delim, each field an atom. The rows are resolved with before the
+    // clauses of the predicate.
+    void load_table(istream& in, string const& name, char const delim) {
+        if (env.running != 0) {
+            throw runtime_error("cannot load " + name + " while queries are running");
+        }
+        predicate& p = env[intern(name)];
+        if (p.table == nullptr) {
+            env.tables.emplace_back(new fact_table);
+            p.table = env.tables.back().get();
+        }
+        fact_table& t = *p.table;
+        string line;
+        vector<uint32_t> row;
+        for (size_t n = 1; getline(in, line); ++n) {
+            if (!line.empty() && line.back() == '\r') {
+                line.pop_back();
+            }
+            if (line.empty()) {
+                continue;
+            }
+            row.clear();
+            for (size_t b = 0, e; b <= line.size(); b = e + 1) {
+                e = line.find(delim, b);
+                if (e == string::npos) {
+                    e = line.size();
+                }
+                if (!is_atom(line, b, e)) {
+                    throw runtime_error(name + " line " + to_string(n) + ": field " + to_string(row.size() + 1)
+                        + " '" + line.substr(b, e - b) + "' is not an atom");
+                }
+                row.push_back(t.intern(line.data() + b, e - b));
+            }
+            if (t.arity == 0 && t.rows == 0 && row.size() <= fact_table::max_arity) {
+                t.arity = row.size();
+                t.columns.resize(t.arity);
+            }
+            if (row.size() != t.arity) {
+                throw runtime_error(name + " line " + to_string(n) + ": " + to_string(row.size())
+                    + " fields, expected " + to_string(t.arity) + " of at most " + to_string(fact_table::max_arity));
+            }
+            for (size_t k = 0; k < t.arity; ++k) {
+                t.columns[k].push_back(row[k]);
+            }
+            ++t.rows;
+        }
+    }
+
+    // a single clause, appended to the program.
+    void assert_rule(istream *f) {
+        set_stream(f);
+        space();
+        if (test(is_colon)) {
+            error("expected", "clause head");
+        }
+        type_clause *const r = parse_rule();
+        space();
+        expect(is_eof);
+        vmap.clear();
+        ground(r);
+        add_clause(env, r);
+    }
+
+    // remove the first clause whose head unifies with the goal, which
+    // queries that are already running still see.
+    bool retract(istream *f) {
+        vector<type_struct*> const goal = parse_goal(f);
+        if (goal.size() != 1) {
+            error("expected", "single goal");
+        }
+        env_type::iterator const i = env.find(goal[0]->functor);
+        if (i != env.end()) {
+            trail unify;
+            for (type_clause *const c : i->second) {
+                if (visible(c, env.generation) && unify.match_goal_rule(goal[0], c)) {
+                    remove_clause(env, c);
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    // a single goal, with or without the leading ":-" and trailing ".".
+    vector<type_struct*> read_goal(istream *f) {
+        set_stream(f);
+        space();
+        if (accept(is_colon)) {
+            expect(is_minus);
+        }
+        vector<type_struct*> goal = parse_structs();
+        accept(is_dot);
+        space();
+        expect(is_eof);
+        vmap.clear();
+        return goal;
+    }
+
+    vector<type_struct*> parse_goal(istream *f) {
+        vector<type_struct*> const goal = read_goal(f);
+        for (type_struct *const g : goal) {
+            ground(g);
+        }
+        return goal;
+    }
+
+    // the clause whose head collects the variables of the goal as an answer.
+    type_clause* query(vector<type_struct*> const& goal) {
+        get_variables gv;
+        return ast.new_type_clause(ast.new_type_struct(names.find("yes")->second, gv(goal), false)
+            , vector<type_variable*> {}, goal);
+    }
+
+    // the clause answering a goal, made in h with the goal's terms so that
+    // they are freed with it; only new atoms are added to the program's
+    // heap. Its structs are not marked ground, so no copy that may outlive
+    // the query shares them.
+    type_clause* query(istream *f, heap& h) {
+        terms = &h;
+        vector<type_struct*> goal;
+        try {
+            goal = read_goal(f);
+        } catch (...) {
+            vmap.clear();
+            terms = &ast;
+            throw;
+        }
+        terms = &ast;
+        get_variables gv;
+        return h.new_type_clause(h.new_type_struct(names.find("yes")->second, gv(goal), false)
+            , vector<type_variable*> {}, goal);
+    }
 
+    atoms& get_names() {
+        return names;
+    }
+
+    env_type& get_env() {
+        return env;
+    }
+
+    // list the program, then solve each of its queries.
+    void run() {
         ///*
-        cout << endl;
-        for (auto const& fun : env) {
-            for (auto const& c : fun.second) {
-                show_type(c);
-                cout << "." << endl;
+        if (!opts.json) {
+            cout << endl;
+            // predicates in the order of their first clauses, rather than of
+            // their atoms, so several files merged list as if concatenated.
+            vector<env_type::value_type const*> listing;
+            for (auto const& fun : env) {
+                listing.push_back(&fun);
+            }
+            auto const first_id = [](env_type::value_type const *const f) {
+                return f->second.empty() ? 0 : f->second.front()->id;
+            };
+            stable_sort(listing.begin(), listing.end()
+                , [&first_id](env_type::value_type const *const a, env_type::value_type const *const b) {
+                return first_id(a) < first_id(b);
+            });
+            for (auto const fp : listing) {
+                auto const& fun = *fp;
+                if (fun.second.table != nullptr) {
+                    cout << "# " << fun.first->value << "/" << fun.second.table->arity
+                        << ": " << fun.second.table->rows << " rows" << endl;
+                }
+                for (auto const& c : fun.second) {
+                    show_type(c);
+                    cout << "." << endl;
+                }
             }
+            cout << endl;
         }
-        cout << endl;
         //*/
 
 
-        get_variables gv;
-        type_clause *answer;
+        type_clause *result;
         //int const count = 100;
-        int const count = 100;
+        int const count = opts.depth;
         context cxt(names, env);
+
+        unique_ptr<clause_profile> prof;
+        if (!opts.profile.empty()) {
+            prof.reset(new clause_profile);
+            ifstream in(opts.profile);
+            prof->load(in, env);
+        }
+
         for (vector<type_struct*> &goal : goals) {
-            cout << ":- ";
-            for (auto g = goal.cbegin(); g != goal.cend(); g++) {
-                show_type(*g);
-                if (g + 1 != goal.cend()) {
-                    cout << ", ";
+            if (prof) {
+                prof->reorder();
+            }
+            if (opts.json) {
+                json_query(goal);
+            } else {
+                cout << ":- ";
+                for (auto g = goal.cbegin(); g != goal.cend(); g++) {
+                    show_type(*g);
+                    if (g + 1 != goal.cend()) {
+                        cout << ", ";
+                    }
                 }
+                cout << "." << endl << endl;
             }
-            cout << "." << endl << endl;
             //for (int i = 0; i < count; ++i) {
             for (int i = count - 1; i < count; ++i) {
-                solver solve(names, env, ast.new_type_clause(ast.new_type_struct(
-                    names.find("yes")->second, gv(goal), false), set<type_variable*> {}, goal), i + 1);
-                answer = solve.get();
-                if (answer != nullptr) {
+                solver solve(names, env, query(goal), i + 1, opts, prof.get());
+                result = solve.get();
+                if (opts.json) {
+                    show_json(solve, result);
+                    solve.stop();
+                    goto next;
+                } else if (result != nullptr) {
                     cout << "DEPTH " << depth_profile::report()
                         << " ELAPSED TIME: " << profile::report() << "us\n";
+                    solve.show_stack(cout);
                     cout << endl;
-                    solve.show_proof(cout);
-                    cout << endl;
-                    show_type(answer->head);
-                    cout << "." << endl << endl;
+                    if (opts.all_solutions) {
+                        show_answers(solve, result);
+                        if (solve.exceeded != solver::none) {
+                            solve.show_statistics(cout);
+                            cout << endl;
+                        }
+                    } else {
+                        if (!opts.answers_only) {
+                            solve.show_proof(cout);
+                            cout << endl;
+                        }
+                        show_type(result->head);
+                        cout << "." << endl << endl;
+                    }
+                    show_memory(solve);
                     solve.stop();
                     goto next;
+                } else if (solve.exceeded != solver::none) {
+                    solve.show_statistics(cout);
+                    cout << endl;
+                    show_memory(solve);
+                    goto next;
                 } else {
                     IF_DEBUG(
                         cout << "DEPTH " << depth_profile::report()
@@ -1858,43 +4527,233 @@ public:
                     );
                 }
 
+                show_memory(solve);
                 solve.stop();
             }
             //cout << "ELAPSED TIME: " << profile::report() / static_cast<double>(count) << "us\n";
             cout << "NP\n\n";
         next: continue;
         }
+
+        if (prof) {
+            ofstream out(opts.profile);
+            prof->save(out, env);
+        }
     }
 };
 
+}
+}
+
 //----------------------------------------------------------------------------
+// Library Interface
+
+namespace clors {
+
+using namespace detail;
+
+term::kind_type term::kind() const {
+    type_expression *const e = find(node);
+    if (dynamic_cast<type_struct*>(e) != nullptr) {
+        return compound;
+    } else if (dynamic_cast<type_atom*>(e) != nullptr) {
+        return atom;
+    } else if (dynamic_cast<type_attrvar*>(e) != nullptr) {
+        return constrained;
+    }
+    return variable;
+}
+
+string term::name() const {
+    type_expression *const e = find(node);
+    if (type_struct *const s = dynamic_cast<type_struct*>(e)) {
+        return s->functor->value;
+    } else if (type_atom *const a = dynamic_cast<type_atom*>(e)) {
+        return a->value;
+    } else if (type_attrvar *const v = dynamic_cast<type_attrvar*>(e)) {
+        return v->var->name;
+    }
+    return static_cast<type_variable*>(e)->name;
+}
+
+size_t term::arity() const {
+    type_struct *const s = dynamic_cast<type_struct*>(find(node));
+    return (s == nullptr) ? 0 : s->args.size();
+}
+
+term term::arg(size_t const i) const {
+    return term(static_cast<type_struct*>(find(node))->args.at(i));
+}
+
+string term::str() const {
+    type_show ts;
+    return ts.value(node);
+}
+
+struct query::impl {
+    heap terms; // the goal and its variables, freed with the query
+    type_clause *const goal;
+    type_struct *const head;
+    solver solve;
+    answer ans;
+    bool started;
+
+    impl(term_parser &parse, istream *const in, options const& opts)
+        : goal(parse.query(in, terms)), head(goal->head)
+        , solve(parse.get_names(), parse.get_env(), goal, opts.depth, opts), started(false) {}
+};
+
+query::query(impl *p) : p(p) {}
+query::query(query&&) = default;
+query& query::operator= (query&&) = default;
+query::~query() = default;
+
+bool query::next() {
+    if (p->started) {
+        return p->solve.next(p->ans);
+    }
+    p->started = true;
+    if (p->solve.get() == nullptr) {
+        return false;
+    }
+    p->ans.assign(p->head);
+    return true;
+}
+
+size_t query::size() const {
+    return p->head->args.size();
+}
+
+string const& query::name(size_t const i) const {
+    return static_cast<type_variable*>(p->head->args.at(i))->name;
+}
+
+term query::value(size_t const i) const {
+    return term(p->ans.bindings.at(i).second);
+}
+
+vector<string> query::proof() const {
+    vector<string> steps;
+    type_show ts;
+    for (type_clause *const c : p->solve.proof()) {
+        steps.push_back(ts.str(c));
+    }
+    return steps;
+}
+
+statistics const& query::stats() const {
+    return p->solve.get_statistics();
+}
+
+char const* query::exceeded() const {
+    return p->solve.exceeded_name();
+}
+
+struct program::impl {
+    options const opts;
+    heap ast;
+    term_parser parse;
+    vector<unique_ptr<heap>> files; // the heaps of files loaded in parallel
 
-int main(int argc, char const *const *argv) {
-    if (argc < 1) {
-        printf("no input files.\n");
-    } else {
-        for (int i(1); i < argc; ++i) {
+    explicit impl(options const& o) : opts(o), parse(ast, opts) {}
+};
+
+program::program(options const& opts) : p(new impl(opts)) {}
+program::~program() = default;
+
+void program::load_file(string const& path) {
+    ifstream in(path);
+    if (!in.is_open()) {
+        throw runtime_error("could not open " + path);
+    }
+    p->parse.load(&in);
+}
+
+// each file is parsed into its own heap, on as many threads as there are
+// cores, then merged in order.
+void program::load_files(vector<string> const& paths) {
+    atom_table shared(p->parse.get_names());
+    vector<unique_ptr<heap>> heaps;
+    vector<unique_ptr<term_parser>> parsers;
+    for (size_t i = 0; i < paths.size(); ++i) {
+        heaps.emplace_back(new heap);
+        parsers.emplace_back(new term_parser(*heaps.back(), p->opts, shared));
+    }
+
+    vector<exception_ptr> errors(paths.size());
+    atomic<size_t> next(0);
+    auto const work = [&]() {
+        for (size_t i; (i = next++) < paths.size();) {
             try {
-                heap ast;
-                term_parser parse(ast);
-                type_show show_type;
-
-                fstream in(argv[i], ios_base::in);
-                if (in.is_open()) {
-                    parse(&in); // FIXME return and execute
-                    in.close();
-                } else {
-                    cerr << "could not open " << argv[i] << "\n";
-                    return 1;
+                ifstream in(paths[i]);
+                if (!in.is_open()) {
+                    throw runtime_error("could not open " + paths[i]);
                 }
-            } catch (parse_error& e) {
-                cerr << argv[i] << ": " << e.what()
-                    << " '" << e.exp
-                    << "' found '" << static_cast<char>(e.sym)
-                    << "' at line " << e.row
-                    << ", column " << e.col << "\n";
-                return 2;
+                parsers[i]->load(&in);
+            } catch (...) {
+                errors[i] = current_exception();
+            }
+        }
+    };
+    size_t const n = min<size_t>(paths.size(), max(1u, thread::hardware_concurrency()));
+    vector<thread> threads;
+    for (size_t i = 1; i < n; ++i) {
+        threads.emplace_back(work);
+    }
+    work();
+    for (thread& t : threads) {
+        t.join();
+    }
+
+    // the atoms made while parsing live in the files' heaps, so they are
+    // published only once every file has loaded, and dropped otherwise.
+    for (size_t i = 0; i < paths.size(); ++i) {
+        if (errors[i]) {
+            try {
+                rethrow_exception(errors[i]);
+            } catch (parse_error const& e) {
+                throw parse_error(paths[i] + ": " + e.what(), e.row, e.col, e.exp, e.sym);
             }
         }
     }
+    shared.publish();
+    for (size_t i = 0; i < paths.size(); ++i) {
+        p->parse.merge(*parsers[i]);
+        p->files.push_back(move(heaps[i]));
+    }
+}
+
+void program::load(string const& text) {
+    istringstream in(text);
+    p->parse.load(&in);
+}
+
+void program::load_table(string const& path, string const& predicate) {
+    ifstream in(path);
+    if (!in.is_open()) {
+        throw runtime_error("could not open " + path);
+    }
+    bool const csv = path.size() >= 4 && path.compare(path.size() - 4, 4, ".csv") == 0;
+    p->parse.load_table(in, predicate, csv ? ',' : '\t');
+}
+
+void program::assertz(string const& clause) {
+    istringstream in(clause);
+    p->parse.assert_rule(&in);
+}
+
+bool program::retract(string const& head) {
+    istringstream in(head);
+    return p->parse.retract(&in);
+}
+
+query program::run(string const& goal) {
+    istringstream in(goal);
+    return query(new query::impl(p->parse, &in, p->opts));
+}
+
+void program::run_all() {
+    p->parse.run();
+}
+
 }
@@ -0,0 +1,179 @@
+// Copyright 2012, 2013, 2014 Keean Schupke
+// Embedding interface: load a program, run queries, iterate their answers.
+
+#ifndef CLORS_HPP
+#define CLORS_HPP
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace clors {
+
+namespace detail {
+class type_expression;
+}
+
+//----------------------------------------------------------------------------
+// Errors: thrown when a program or query does not parse.
+
+struct parse_error : public std::runtime_error {
+    int const row;
+    int const col;
+    int const sym;
+    std::string const exp;
+    parse_error(std::string const& what, int row, int col, std::string exp, int sym)
+        : runtime_error(what), row(row), col(col), sym(sym), exp(std::move(exp)) {}
+};
+
+//----------------------------------------------------------------------------
+// Resource Budget: per query limits, zero is unlimited.
+
+struct budget {
+    uint64_t inferences;
+    uint64_t time; // wall time in microseconds
+    size_t heap_nodes;
+    size_t trail_entries;
+
+    budget() : inferences(0), time(0), heap_nodes(0), trail_entries(0) {}
+};
+
+// peak bytes by what holds them, measured when options::memory is set.
+struct memory_use {
+    size_t terms; // variables, structs, clauses and goal lists
+    size_t constraints; // attributed variables
+    size_t trail; // the trail and the unification work lists
+    size_t choice_points;
+    size_t frontier; // best first resolvents
+    size_t total; // the peak of the sum, not the sum of the peaks
+
+    memory_use() : terms(0), constraints(0), trail(0), choice_points(0), frontier(0), total(0) {}
+};
+
+struct statistics {
+    uint64_t inferences;
+    uint64_t time;
+    size_t peak_heap_nodes;
+    size_t peak_trail_entries;
+    memory_use peak_memory;
+
+    statistics() : inferences(0), time(0), peak_heap_nodes(0), peak_trail_entries(0) {}
+};
+
+//----------------------------------------------------------------------------
+// Options
+
+struct options {
+    bool all_solutions;
+    bool fail_first; // select the goal with the fewest candidate clauses
+    budget limits;
+    std::string profile; // clause statistics file, empty for source order
+    bool best_first; // expand the cheapest resolvent rather than the deepest
+    std::map<std::string, unsigned> weights; // best first cost of each predicate, default 1
+    bool json; // one line of JSON per query
+    bool answers_only; // keep no proofs, only the bindings of the query
+    int depth; // the depth bound of the search
+    bool memory; // measure the bytes each query holds, see memory_use
+    unsigned parallel; // worker threads solving independent goals, zero for none, capped at the cores
+
+    options() : all_solutions(false), fail_first(false), best_first(false), json(false)
+        , answers_only(false), depth(100), memory(false), parallel(0) {}
+};
+
+//----------------------------------------------------------------------------
+// Term: a handle on part of an answer, valid until its query moves to the
+// next answer.
+
+class term {
+    friend class query;
+    detail::type_expression *node;
+
+    explicit term(detail::type_expression *node) : node(node) {}
+
+public:
+    enum kind_type {variable, constrained, atom, compound};
+
+    kind_type kind() const;
+    std::string name() const; // the atom, functor or variable name
+    size_t arity() const;
+    term arg(size_t i) const;
+    std::string str() const; // as the command line shows it
+};
+
+//----------------------------------------------------------------------------
+// Query: the answers to a goal, found one at a time. A query must not
+// outlive the program it was run on.
+
+class query {
+    friend class program;
+    struct impl;
+    std::unique_ptr<impl> p;
+
+    explicit query(impl *p);
+
+public:
+    query(query&&);
+    query& operator= (query&&);
+    ~query();
+
+    // find the next answer, false when there are no more.
+    bool next();
+
+    // the variables of the goal and their values in the current answer.
+    size_t size() const;
+    std::string const& name(size_t i) const;
+    term value(size_t i) const;
+
+    // the clauses of the current proof, empty when proofs are not kept.
+    std::vector<std::string> proof() const;
+
+    statistics const& stats() const;
+    char const* exceeded() const; // the resource that stopped the search, or "none"
+};
+
+//----------------------------------------------------------------------------
+// Program: clauses and queries loaded from files or text, each load adds to
+// the program. Clauses may be added and removed while queries are running,
+// a query sees the clauses as they were when each of its calls was made.
+
+class program {
+    struct impl;
+    std::unique_ptr<impl> p;
+
+public:
+    explicit program(options const& opts = options {});
+    ~program();
+
+    void load_file(std::string const& path);
+    void load(std::string const& text);
+
+    // add the clauses and queries of several files, parsed in parallel, as
+    // if they were loaded in order. A parse error names its file, and adds
+    // none of the files.
+    void load_files(std::vector<std::string> const& paths);
+
+    // add the rows of a tab separated file, or comma separated if its name
+    // ends ".csv", as ground facts of predicate; each field is an atom.
+    // Tables must not be loaded while a query is running.
+    void load_table(std::string const& path, std::string const& predicate);
+
+    // add a clause after the others of its predicate, such as "p(X) :- q(X).".
+    void assertz(std::string const& clause);
+
+    // remove the first clause whose head unifies with a goal such as
+    // "p(a)", false if there is none.
+    bool retract(std::string const& head);
+
+    // run a goal, such as "append(X, Y, cons(a, nil))".
+    query run(std::string const& goal);
+
+    // list the program, then solve its queries, printing to standard output.
+    void run_all();
+};
+
+}
+
+#endif
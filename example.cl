@@ -69,3 +69,25 @@ Cxt, Typ).
 
 :- expr(let(id, lam(x, var(x)), var(id)), C, T).
 
+
+#-----------------------------------------------------------------------------
+# dif/2 constraints survive backtracking over a joined constraint store,
+# there is no answer: X = Y = a violates dif(X, a).
+
+eqv(Z, Z).
+pick(c).
+pick(a).
+pick(b).
+check(V).
+notc(a).
+notc(b).
+t(X, Y) :-
+    eqv(X, W),
+    dif(X, a),
+    dif(Y, b),
+    eqv(X, Y),
+    pick(Y),
+    check(W),
+    notc(X).
+
+:- t(X, Y).
@@ -0,0 +1,149 @@
+// Copyright 2012, 2013, 2014 Keean Schupke
+// Synthetic workload generator: writes a clors program of a given shape to
+// standard output, for measuring how parsing, indexing, unification and
+// search scale.
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+
+using namespace std;
+
+struct shape {
+    uint64_t facts; // in total, split evenly between the tables
+    unsigned fanout; // tables, and the clauses of rule/2 that read them
+    unsigned depth; // of the recursion of chain/3 above rule/2
+    unsigned term_size; // nodes in each fact value
+    unsigned dif_percent; // of rule/2 clauses that check a dif/2 constraint
+    unsigned queries;
+    unsigned seed;
+
+    shape() : facts(1000), fanout(4), depth(10), term_size(3), dif_percent(20), queries(10), seed(1) {}
+};
+
+class generator {
+    shape const s;
+    mt19937 rng;
+    string buf;
+
+    unsigned below(unsigned const n) {
+        return uniform_int_distribution<unsigned>(0, n - 1)(rng);
+    }
+
+    void flush() {
+        cout.write(buf.data(), buf.size());
+        buf.clear();
+    }
+
+    // a ground term of n nodes, over a small alphabet so that values are
+    // sometimes equal.
+    void term(unsigned n) {
+        static char const *const atoms[] = {"a", "b", "c", "d"};
+        static char const *const functors[] = {"f", "g", "h"};
+        if (n <= 1) {
+            buf += atoms[below(4)];
+            return;
+        }
+        --n;
+        unsigned const arity = (n == 1) ? 1 : 1 + below(2);
+        buf += functors[below(3)];
+        buf += '(';
+        unsigned const left = (arity == 1) ? n : 1 + below(n - 1);
+        term(left);
+        if (arity == 2) {
+            buf += ", ";
+            term(n - left);
+        }
+        buf += ')';
+    }
+
+    void nat(unsigned const n) {
+        for (unsigned i = 0; i < n; ++i) {
+            buf += "s(";
+        }
+        buf += 'z';
+        buf.append(n, ')');
+    }
+
+public:
+    explicit generator(shape const& s) : s(s), rng(s.seed) {}
+
+    void operator() () {
+        buf += "# gen -f " + to_string(s.facts) + " -b " + to_string(s.fanout)
+            + " -d " + to_string(s.depth) + " -t " + to_string(s.term_size)
+            + " -c " + to_string(s.dif_percent) + " -q " + to_string(s.queries)
+            + " -s " + to_string(s.seed) + "\n\n";
+        for (uint64_t i = 0; i < s.facts; ++i) {
+            buf += "table" + to_string(i % s.fanout) + "(k" + to_string(i) + ", ";
+            term(s.term_size);
+            buf += ").\n";
+            if (buf.size() > 65536) {
+                flush();
+            }
+        }
+        buf += '\n';
+        for (unsigned i = 0; i < s.fanout; ++i) {
+            buf += "rule(K, V) :- table" + to_string(i) + "(K, V)";
+            if (below(100) < s.dif_percent) {
+                buf += ", dif(V, ";
+                term(s.term_size);
+                buf += ')';
+            }
+            buf += ".\n";
+        }
+        buf += "\nchain(z, K, V) :- rule(K, V).\n"
+            "chain(s(N), K, V) :- chain(N, K, V).\n\n";
+        for (unsigned i = 0; i < s.queries; ++i) {
+            buf += ":- chain(";
+            nat(s.depth);
+            buf += ", k" + to_string(s.facts == 0 ? 0 : uniform_int_distribution<uint64_t>(0, s.facts - 1)(rng))
+                + ", V).\n";
+        }
+        flush();
+    }
+};
+
+void usage(char const *const name) {
+    cerr << "usage: " << name << " [-f facts] [-b fanout] [-d depth] [-t term size] [-c dif percent]\n"
+        << "    [-q queries] [-s seed]\n"
+        << "  -f  facts in total, default 1000\n"
+        << "  -b  fact tables, and clauses of rule/2 reading them, default 4\n"
+        << "  -d  recursion depth of chain/3 above rule/2, default 10\n"
+        << "  -t  nodes in each fact's value, default 3\n"
+        << "  -c  percentage of rule/2 clauses with a dif/2 constraint, default 20\n"
+        << "  -q  queries, each looking up a random key, default 10\n"
+        << "  -s  random seed, default 1\n";
+}
+
+int main(int argc, char const *const *argv) {
+    shape s;
+    for (int i = 1; i < argc; ++i) {
+        string const opt(argv[i]);
+        if (opt.size() != 2 || opt[0] != '-' || i + 1 >= argc) {
+            usage(argv[0]);
+            return 1;
+        }
+        uint64_t const n = strtoull(argv[++i], nullptr, 10);
+        switch (opt[1]) {
+            case 'f': s.facts = n; break;
+            case 'b': s.fanout = n; break;
+            case 'd': s.depth = n; break;
+            case 't': s.term_size = n; break;
+            case 'c': s.dif_percent = n; break;
+            case 'q': s.queries = n; break;
+            case 's': s.seed = n; break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (s.fanout == 0 || s.term_size == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    generator gen(s);
+    gen();
+}
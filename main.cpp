@@ -0,0 +1,155 @@
+// Copyright 2012, 2013, 2014 Keean Schupke
+// Command line client of the clors library.
+
+#include "clors.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+void usage(char const *const name) {
+    cerr << "usage: " << name << " [-a] [-f] [-i inferences] [-t ms] [-n heap nodes] [-u trail entries] [-p profile]\n"
+        << "    [-b] [-w predicate=weight] [-j] [-q] [-m] [-T predicate=table] [-c] [-P threads] file...\n"
+        << "  -a  print every answer, not just the first\n"
+        << "  -f  fail first: resolve the goal with the fewest candidate clauses\n"
+        << "  -i  maximum inferences per query\n"
+        << "  -t  maximum wall time per query in milliseconds\n"
+        << "  -n  maximum heap nodes per query\n"
+        << "  -u  maximum trail entries per query\n"
+        << "  -p  order clauses by the success statistics in profile, updating it\n"
+        << "  -b  best first: expand the resolvent with the least depth plus goal weights\n"
+        << "  -w  the best first weight of a predicate's goals, default 1\n"
+        << "  -j  print a line of JSON per query with its answers, proofs and statistics\n"
+        << "  -q  answers only: keep no proofs, print answers without them\n"
+        << "  -m  report the peak bytes of each query by what holds them\n"
+        << "  -T  load the rows of a tab (or .csv comma) separated table as facts of predicate\n"
+        << "  -c  combine the files into one program, parsing them in parallel\n"
+        << "  -P  solve independent goals on this many worker threads\n";
+}
+
+void show_parse_error(clors::parse_error const& e) {
+    cerr << e.what()
+        << " '" << e.exp
+        << "' found '" << static_cast<char>(e.sym)
+        << "' at line " << e.row
+        << ", column " << e.col << "\n";
+}
+
+// a decimal count filling the whole argument, false for anything else,
+// including a sign or a value that does not fit.
+bool parse_count(char const *const arg, uint64_t &n) {
+    if (!isdigit(static_cast<unsigned char>(arg[0]))) {
+        return false;
+    }
+    char *end;
+    errno = 0;
+    n = strtoull(arg, &end, 10);
+    return *end == '\0' && errno == 0;
+}
+
+int main(int argc, char const *const *argv) {
+    clors::options opts;
+    vector<pair<string, string>> tables;
+    bool combine = false;
+    int i(1);
+    for (; i < argc && argv[i][0] == '-'; ++i) {
+        string const opt(argv[i]);
+        if (opt == "-a") {
+            opts.all_solutions = true;
+        } else if (opt == "-f") {
+            opts.fail_first = true;
+        } else if (opt == "-q") {
+            opts.answers_only = true;
+        } else if (opt == "-c") {
+            combine = true;
+        } else if (opt == "-m") {
+            opts.memory = true;
+        } else if (opt == "-j") {
+            opts.json = true;
+        } else if (opt == "-b") {
+            opts.best_first = true;
+        } else if (opt == "-w" && i + 1 < argc) {
+            string const w(argv[++i]);
+            size_t const eq = w.find('=');
+            uint64_t n;
+            if (eq == string::npos || !parse_count(w.c_str() + eq + 1, n) || n > numeric_limits<unsigned>::max()) {
+                usage(argv[0]);
+                return 1;
+            }
+            opts.weights[w.substr(0, eq)] = static_cast<unsigned>(n);
+        } else if (opt == "-T" && i + 1 < argc) {
+            string const t(argv[++i]);
+            size_t const eq = t.find('=');
+            if (eq == string::npos) {
+                usage(argv[0]);
+                return 1;
+            }
+            tables.emplace_back(t.substr(0, eq), t.substr(eq + 1));
+        } else if (opt == "-p" && i + 1 < argc) {
+            opts.profile = argv[++i];
+        } else if (opt.size() == 2 && string("itnuP").find(opt[1]) != string::npos && i + 1 < argc) {
+            uint64_t n;
+            if (!parse_count(argv[++i], n)) {
+                usage(argv[0]);
+                return 1;
+            }
+            switch (opt[1]) {
+                case 'i': opts.limits.inferences = n; break;
+                case 't': opts.limits.time = 1000 * n; break;
+                case 'n': opts.limits.heap_nodes = n; break;
+                case 'u': opts.limits.trail_entries = n; break;
+                case 'P': opts.parallel = static_cast<unsigned>(min<uint64_t>(n, thread::hardware_concurrency())); break;
+            }
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (i >= argc) {
+        printf("no input files.\n");
+    } else if (combine) {
+        try {
+            clors::program prog(opts);
+            for (auto const& t : tables) {
+                prog.load_table(t.second, t.first);
+            }
+            prog.load_files(vector<string>(argv + i, argv + argc));
+            prog.run_all();
+        } catch (clors::parse_error& e) {
+            show_parse_error(e);
+            return 2;
+        } catch (runtime_error& e) {
+            cerr << e.what() << "\n";
+            return 1;
+        }
+    } else {
+        for (; i < argc; ++i) {
+            try {
+                clors::program prog(opts);
+                for (auto const& t : tables) {
+                    prog.load_table(t.second, t.first);
+                }
+                prog.load_file(argv[i]);
+                prog.run_all();
+            } catch (clors::parse_error& e) {
+                cerr << argv[i] << ": ";
+                show_parse_error(e);
+                return 2;
+            } catch (runtime_error& e) {
+                cerr << e.what() << "\n";
+                return 1;
+            }
+        }
+    }
+}